@@ -0,0 +1,68 @@
+#!/bin/sh
+# Generates synthetic files and keystroke scripts under build/bench, then
+# replays each script headlessly against each file and prints what crate
+# measured. Usage: bench/bench.sh [path/to/crate]
+
+set -e
+
+CRATE=${1:-build/crate}
+DIR=build/bench
+SIZE=${CRATE_BENCH_SIZE:-50x160}
+mkdir -p "$DIR"
+
+# a million short lines of plain text
+if [ ! -f "$DIR/plain.txt" ]; then
+    awk 'BEGIN {
+        for (i = 0; i < 1000000; i++)
+            printf "%d the quick brown fox jumps over the lazy dog %d\n", i, i * 7919 % 100003
+    }' > "$DIR/plain.txt"
+fi
+
+# indented source-like text with tabs, every 1000th line 20k chars long
+if [ ! -f "$DIR/tabs.txt" ]; then
+    awk 'BEGIN {
+        for (i = 0; i < 200000; i++) {
+            if (i % 1000 == 999) {
+                for (j = 0; j < 2000; j++)
+                    printf "\tx = %d;", j
+                printf "\n"
+            }
+            else {
+                for (j = 0; j < i % 4; j++)
+                    printf "\t"
+                printf "if (a[%d] > b) {\treturn c;\t}\n", i
+            }
+        }
+    }' > "$DIR/tabs.txt"
+fi
+
+# typing: words, newlines and backspaces spread over the top of the file
+awk 'BEGIN {
+    for (i = 0; i < 200; i++) {
+        printf "hello, world "
+        if (i % 10 == 9)
+            printf "\r\033[B\033[B"
+        if (i % 25 == 24)
+            printf "\177\177\177\177"
+    }
+}' > "$DIR/typing.keys"
+
+# navigation: paging down and back, walking along lines
+awk 'BEGIN {
+    for (i = 0; i < 300; i++)
+        printf "\033[6~"
+    for (i = 0; i < 200; i++)
+        printf "\033[B\033[F\033[H"
+    for (i = 0; i < 400; i++)
+        printf "\033[C"
+    for (i = 0; i < 300; i++)
+        printf "\033[5~"
+}' > "$DIR/nav.keys"
+
+for file in plain tabs; do
+    for keys in typing nav; do
+        echo "== $file.txt / $keys.keys ($SIZE)"
+        "$CRATE" --bench "$SIZE" "$DIR/$keys.keys" "$DIR/$file.txt"
+        echo
+    done
+done
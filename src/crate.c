@@ -7,23 +7,71 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <wchar.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /*** ---------- DEFINES ---------- ***/
 
 #define CRATE_VERSION "0.0.1"
 #define CRATE_TAB_STOP 8
 #define CRATE_QUIT_TIMES 3
+#define CRATE_MAX_WORKERS 64
+#define CRATE_SCAN_CHUNK (8 * 1024 * 1024)  // bytes per newline scan task
+#define CRATE_RENDER_ROWS 1024  // rows whose render is kept between frames
+#define CRATE_RENDER_BYTES (16 * 1024 * 1024)  // ... and how much they may hold
+#define CRATE_GAP_MIN 64  // smallest gap opened in the row being typed into
+#define CRATE_RX_CHECKPOINT 256  // chars between cached cx -> rx checkpoints
+#define CRATE_TRACE_EVENTS 4096  // spans kept for the HUD and trace dumps
+#define CRATE_ESC_TIMEOUT 100  // ms to wait for the rest of an escape sequence
+#define CRATE_PASTE_TIMEOUT 1000  // ms a paste may stall before it is taken as ended
+#define CRATE_SAVE_IOV 512  // iovecs per writev when saving, two per row
+#define CRATE_MSG_TIMEOUT 5  // seconds a status message stays up
+#define CRATE_MAX_TIMERS 8  // callbacks the event loop can have pending
+#define CRATE_INPUT_BUF 4096  // bytes taken from the terminal per read
+#define CRATE_FRAME_BUDGET 30  // ms of queued keys applied before a frame is forced
+#define CRATE_UNDO_BUDGET (16 * 1024 * 1024)  // undo history kept in memory
+#define CRATE_UNDO_GROUP_MS 1000  // typing pause that starts a new undo step
+#define CRATE_SWAP_MAGIC "CRSWP01\n"
+#define CRATE_SWAP_DELAY 10  // ms a swap commit waits for more edits to join it
+#define CRATE_SEARCH_SLICE (1024 * 1024)  // bytes searched between checks for input
+#define CRATE_INDEX_BLOCK (256 * 1024)  // bytes of the file per search index block
+#define CRATE_INDEX_BITS 16  // log2 of the trigram bits kept per block
+#define CRATE_INDEX_TICK 250  // ms between status bar updates while the index builds
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+// erow flags
+#define ROW_MAPPED 0x01  // chars points into E.map and is not ours to free
+#define ROW_RAW 0x02  // nothing to expand, render is chars itself
+#define ROW_HL 0x04  // hlout follows from hlin for the chars as they are now
+#define ROW_ASCII 0x08  // known to be all ASCII: every byte is one column
+#define ROW_UTF8 0x10  // known not to be: columns are decoded from the chars
+#define ROW_WIDE 0x20  // may have double width chars: soft wrap walks its chars
+#define ROW_TAIL 0x40  // ... and was only walked as far as the screen needs: lines is a guess
+
 
 enum editorKey {
     BACKSPACE = 127,
@@ -36,6 +84,44 @@ enum editorKey {
     END_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    PASTE_START,  // \x1b[200~, the text up to \x1b[201~ was pasted
+};
+
+// stages timed into the trace ring
+enum traceKind {
+    TRACE_READ = 0,  // decoding a key once its first byte arrived
+    TRACE_PROCESS,
+    TRACE_BUILD,  // building a frame
+    TRACE_WRITE,  // writing it to the terminal
+    TRACE_OPEN,
+    TRACE_SAVE,
+    TRACE_KINDS
+};
+
+enum undoKind {
+    UNDO_INSERT = 0,
+    UNDO_APPEND,  // an insert past the last row, which added the row
+    UNDO_DELETE,
+    UNDO_REPLACE  // rows whose chars were swapped for others, see editorReplaceRows
+};
+
+enum editorHighlight {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER,
+    HL_PREPROC
+};
+
+// where the lexer is at the end of a row, and so at the start of the next
+enum syntaxState {
+    SYN_CODE = 0,
+    SYN_COMMENT,  // inside /* */
+    SYN_STRING,  // a string continued with a backslash
+    SYN_LINE_COMMENT,  // a // comment continued with a backslash
+    SYN_PREPROC  // a directive continued with a backslash
 };
 
 /*** ---------- DATA ---------- ***/
@@ -44,47 +130,385 @@ typedef struct erow {
     int size;
     int rsize;
     char *chars;
-    char *render;
+    char *render;  // filled on demand by editorRowRender, NULL when stale
+    int rcap;  // bytes allocated for render, with slack for edits
+    int rslot;  // slot in the render cache, -1 if render is NULL
+    int flags;
+    unsigned char hlin, hlout;  // lexer state at the start and end of the row
+    int cols;  // columns it takes on screen, -1 until laid out for soft wrap
+    int lines;  // screen lines it wraps to at E.wrapcols
 } erow;
 
+// render buffers are a cache: only rows that have been drawn hold one, and
+// the least recently drawn are freed once there are too many of them
+struct renderSlot {
+    erow *row;
+    int prev;
+    int next;
+    int *cps; // cps[i] is the rx of char i * CRATE_RX_CHECKPOINT
+    int ncps; // how many of them are still valid
+    int cpcap;
+    int *wcps; // with soft wrap, the screen line of char i * CRATE_RX_CHECKPOINT
+               // and how far along it the char is, two ints each
+    int nwcps;
+    int wcpcap;
+    int wcols; // screencols they were laid out at
+    int wide; // double width chars in the row, -1 until it is laid out
+    int lasttab; // ... and the char of its last tab, -1 if none
+};
+
+// how far laying out a wrapped row has got: char j, at column at, which is
+// x along screen line line
+struct wrapPos {
+    int j;
+    int at;
+    int x;
+    int line;
+};
+
+// a long row that is not ASCII as it was laid out just before a one byte
+// edit, so the layout after it can be patched instead of redone
+struct layoutEdit {
+    int cols;  // of the row, -1 if it has to be laid out in full
+    int wide;  // double width chars among those the edit can change
+    int span;  // ... and the columns those chars cover
+    int anchor;  // with a tab past the edit, the char columns are compared at, else -1
+    int rx;  // ... and its column before the edit
+};
+
+// something for the event loop to call once a deadline passes
+struct editorTimer {
+    long long when; // ns on the trace clock
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+// frame buffers live as long as the editor: they grow geometrically and are
+// only reset between frames, so drawing does not allocate once warmed up
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0};
+
+// what the terminal is currently showing on one screen line
+struct frameLine {
+    char *b;
+    int len;
+    int cap;
+};
+
+// rows live in an implicit treap ordered by position in the file. Each node
+// caches the number of rows in its subtree, so finding, inserting and deleting
+// rows is O(log n) and whole spans can be split off or spliced in at once
+typedef struct rowNode {
+    erow row;  // must stay first so an erow pointer converts back to its node
+    struct rowNode *left;
+    struct rowNode *right;
+    struct rowNode *parent;
+    unsigned int prio;
+    int count;  // rows in this subtree
+    long long bytes;  // ... and their chars plus newlines
+    char *span;  // where the subtree starts in E.map when its rows are still
+                 // one unbroken stretch of the file, newlines included
+    int vlines;  // screen lines its rows wrap to
+    int stale;  // some row in it has to be laid out again
+} rowNode;
+
+struct editorSyntax {
+    char *filetype;
+    char **filematch;
+    char **keywords;  // types end in |
+};
+
 struct editorConfig {
     int cx, cy;
     int rx; // holds index into rendered line text
     int rowoff; // keep track of the row user is scrolled to
     int coloff; //keep track of what column the user is scrolled to
+    int wrap; // soft wrap long rows instead of scrolling sideways
+    int wrapoff; // screen lines of row rowoff scrolled off the top when wrapping
+    int wrapcols; // screencols the wrap layout was made for
+    int cury, curx; // where on screen the cursor goes
     int screenrows; // rows in terminal window
     int screencols; // columns in terminal window
     int numrows;
-    erow *row; // array of erows holding file lines
+    rowNode *rows; // treap of erows holding file lines
+    rowNode *freenodes; // recycled nodes, chained through ->right
+    erow *gaprow; // row holding a gap buffer at gapstart, NULL if none
+    int gapstart;
+    int gaplen;
+    unsigned int seed; // state for treap priorities
     int dirty;  // boolean = Has the file been changed without saving
+    struct renderSlot *rcache;
+    int rhead, rtail; // most and least recently drawn rows
+    int rfree; // unused slots, chained through ->next
+    size_t rbytes; // memory held by cached renders
+    size_t rshared; // bytes on screen rendered straight from chars
+    struct frameLine *frame; // last emitted contents of every screen line
+    int framerows;
+    int framevalid; // 0 forces the next refresh to repaint everything
+    int frametop; // rowoff the frame was drawn at, or its screen line when wrapping
+    int framecoloff;
+    struct abuf out; // escape sequences for the frame being built
+    struct abuf line; // scratch for one screen line
     char *filename;
+    struct editorSyntax *syntax;  // NULL when the file type has none
+    int hlvalid;  // rows before this one are lexed from the right state
+    unsigned char *hl;  // highlight of every render column of the row being drawn
+    int hlcap;
+    char *map; // read-only view of the file, unmodified rows point into it
+    size_t maplen;
+    int mapfd; // the file map is a view of, -1 if none
+    struct stat mapst; // mapfd as it was when mapped or last patched
+    long pagesize;
+    volatile sig_atomic_t mapcut; // map was read past the end of a truncated file
     char statusmsg[80];
     time_t statusmsg_time;
+    int sigfd; // signalfd delivering SIGWINCH, SIGHUP and SIGTERM, -1 if none
+    struct editorTimer timers[CRATE_MAX_TIMERS];
+    int ntimers;
     struct termios orig_termios;
+    int infd; // terminal, or the keystroke script when headless
+    char inbuf[CRATE_INPUT_BUF]; // read but not yet decoded input
+    int inpos, inlen;
+    long long frameinterval; // ns between frames when capped by CRATE_FPS, else 0
+    long long lastframe; // when the last frame was written
+    int outfd; // terminal, or the output sink when headless
+    int headless; // no tty: fixed screen size, stop at the end of input
+    int hangup; // the terminal went away: nothing is restored on it at exit
+    size_t outbytes; // everything written to outfd so far
 };
 
 struct editorConfig E;
 
+// what a headless run measures, reported at exit
+struct benchStats {
+    long long open_ns;
+    long long first_ns; // building and writing the first frame
+    size_t first_bytes;
+    long long *lat; // per keystroke, processing plus the frame after it
+    size_t *bytes; // ... and what that frame wrote
+    int n;
+    int cap;
+};
+
+struct benchStats B;
+
+struct traceEvent {
+    unsigned long long seq; // position it was recorded at plus one, 0 while written
+    int kind;
+    int tid;
+    long long start; // ns
+    long long dur;
+};
+
+struct traceRing {
+    struct traceEvent events[CRATE_TRACE_EVENTS];
+    unsigned long long head; // events recorded so far
+    long long last[TRACE_KINDS]; // latest duration of every kind
+    long long base; // when the editor started
+    int hud; // show the latest durations in the status bar
+};
+
+struct traceRing T;
+
+// one edit as text inserted at or deleted from (y, x), whose other end is
+// (ey, ex): where the cursor lands after an insert, or where the deleted
+// text ended. Lines in text are separated by \n
+struct undoOp {
+    int kind;
+    int y, x;
+    int ey, ex;
+    int typed;  // single typed chars, later keystrokes may join it
+    long long when;
+    size_t len;
+    char *text;
+};
+
+// newest ops are at the top. Once the journal outgrows its budget the
+// oldest ones are written out to a temp file and read back when reached
+struct undoStack {
+    struct undoOp *ops;  // ops[first .. first + n), oldest first
+    int first, n, cap;
+    size_t bytes;  // held in memory by ops and their text
+    FILE *spill;  // older ops below the in memory ones, NULL until needed
+    off_t spillend;
+    long nspilled;
+};
+
+struct undoJournal {
+    struct undoStack undo;
+    struct undoStack redo;
+    size_t budget;
+    int sealed;  // the next edit starts a new step
+};
+
+struct undoJournal U;
+
+// starts every swap journal: the file its edits apply to
+struct swapHeader {
+    char magic[8];
+    long long size;
+    long long mtime;  // ns
+    unsigned long long ino;
+};
+
+// ... followed by one of these per edit, then its text
+struct swapEntry {
+    unsigned int crc;  // of the rest of the record, text included
+    unsigned int len;
+    int kind;
+    int backwards;  // undone rather than done
+    int y, x;
+    int ey, ex;
+};
+
+struct swapJournal {
+    int running;
+    char *path;
+    int fd;  // the journal, locked for as long as it is open; only the writer uses it
+    int fresh;  // nothing has been written to fd yet, not even a header
+    pthread_t thread;
+    pthread_mutex_t lock;  // guards the rest
+    pthread_cond_t wake;
+    struct abuf queue;  // records the writer has not taken yet
+    struct swapHeader header;
+    int restart;  // the file was saved, truncate the journal
+    int stop;
+    int idle;  // the writer is waiting for wake
+};
+
+struct swapJournal S;
+
+// which trigrams may occur in each block of E.map, so a search can pass
+// over the blocks that cannot hold a match. Built in the background
+struct searchIndex {
+    int running;
+    pthread_t thread;
+    char *map;  // the mapping it covers
+    size_t maplen;
+    int nblocks;
+    unsigned long long *bits;  // 1 << CRATE_INDEX_BITS bits per block
+    int built;  // blocks done so far, stored with release order
+    int stop;
+};
+
+struct searchIndex I;
+
+const char *traceNames[TRACE_KINDS] = {"read", "process", "build", "write", "open", "save"};
+
 /*** ---------- PROTOTYPES ---------- ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt);
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void initEditor();
+int editorWaitInput();
+void editorFrameInit(int rows);
+void undoRecord(int kind, int y, int x, int ey, int ex, const char *s, size_t len);
+void swapRecord(int kind, int backwards, int y, int x, int ey, int ex,
+                const char *text, size_t len);
+void abAppend(struct abuf *ab, const char *s, int len);
+void abReset(struct abuf *ab);
+void abFree(struct abuf *ab);
+int editorWritev(int fd, struct iovec *iov, int cnt);
+void syntaxRowChanged(erow *row);
+void editorSelectSyntaxHighlight();
+void syntaxInvalidate(int y);
+void editorRowLayoutBefore(erow *row, int at, int c, int inserted, struct layoutEdit *le);
+void editorRowLayoutAfter(erow *row, int at, int c, int inserted, struct layoutEdit *le);
+
+/*** ---------- trace ---------- ***/
+
+long long traceNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// records a span from start until now. Any thread may call this: a slot is
+// claimed with one atomic add and stamped with its sequence once filled in,
+// so readers can tell finished slots from ones being overwritten
+void traceSpan(int kind, int tid, long long start) {
+    long long dur = traceNow() - start;
+    unsigned long long i = __atomic_fetch_add(&T.head, 1, __ATOMIC_RELAXED);
+    struct traceEvent *ev = &T.events[i % CRATE_TRACE_EVENTS];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&ev->kind, kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->tid, tid, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->dur, dur, __ATOMIC_RELAXED);
+    __atomic_store_n(&ev->seq, i + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&T.last[kind], dur, __ATOMIC_RELAXED);
+}
+
+// copies out event i, failing if it was overwritten or is still being written
+int traceRead(unsigned long long i, struct traceEvent *out) {
+    struct traceEvent *ev = &T.events[i % CRATE_TRACE_EVENTS];
+    if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != i + 1) {
+        return 0;
+    }
+    out->kind = __atomic_load_n(&ev->kind, __ATOMIC_RELAXED);
+    out->tid = __atomic_load_n(&ev->tid, __ATOMIC_RELAXED);
+    out->start = __atomic_load_n(&ev->start, __ATOMIC_RELAXED);
+    out->dur = __atomic_load_n(&ev->dur, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&ev->seq, __ATOMIC_RELAXED) == i + 1;
+}
+
+// writes the ring as Chrome trace events (chrome://tracing, Perfetto) to
+// the file named by CRATE_TRACE. Registered to run at exit
+void traceDump() {
+    const char *path = getenv("CRATE_TRACE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return;
+    }
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    unsigned long long head = __atomic_load_n(&T.head, __ATOMIC_ACQUIRE);
+    unsigned long long i = head > CRATE_TRACE_EVENTS ? head - CRATE_TRACE_EVENTS : 0;
+    int first = 1;
+    for (; i < head; i++) {
+        struct traceEvent ev;
+        if (!traceRead(i, &ev)) {
+            continue;
+        }
+        fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%d}",
+                first ? "" : ",\n", traceNames[ev.kind], (ev.start - T.base) / 1e3,
+                ev.dur / 1e3, (int)getpid(), ev.tid);
+        first = 0;
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(fp);
+}
 
 /*** ---------- TERMINAL ---------- ***/
 
 void die(const char *s) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    write(E.outfd, "\x1b[2J", 4);
+    write(E.outfd, "\x1b[H", 3);
 
     perror(s);
     exit(1);
 }
 
+// runs at exit, so it must not die(): exiting again from an atexit handler
+// is undefined. A terminal that hung up is left alone
 void disableRawMode() {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
-        die("tcsetattr");
+    if (E.hangup) {
+        return;
     }
+    write(E.outfd, "\x1b[?2004l", 8);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
 }
 
 void enableRawMode() {
@@ -109,37 +533,92 @@ void enableRawMode() {
     //c_cc CONTROL CHARS
     // VMIN - set min number of bytes needed before read can return 
     // VTIME - set max amount of time read will wait
+    // both 0: read never blocks, the event loop polls for input instead
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
     // SET TERMINAL INPUT SETTINGS
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         die("tcsetattr");
     }
+    // bracketed paste: the terminal marks pasted text so it can go in as
+    // one block instead of being typed in
+    write(E.outfd, "\x1b[?2004h", 8);
 
     atexit(disableRawMode);
 }
 
-int editorReadKey() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) {
-            die("read");
+// the next byte of input without blocking: left over from the last read, or
+// else from one read taking in everything the terminal has queued
+int editorInputByte(char *c) {
+    if (E.inpos == E.inlen) {
+        int nread = read(E.infd, E.inbuf, sizeof(E.inbuf));
+        if (nread <= 0) {
+            return nread;
+        }
+        E.inpos = 0;
+        E.inlen = nread;
+    }
+    *c = E.inbuf[E.inpos++];
+    return 1;
+}
+
+// whether a key can be read within ms. Headless runs say no, so that every
+// scripted key gets a frame of its own to be measured by
+int editorInputReady(int ms) {
+    if (E.headless) {
+        return 0;
+    }
+    if (E.inpos < E.inlen) {
+        return 1;
+    }
+    struct pollfd pfd = {E.infd, POLLIN, 0};
+    return poll(&pfd, 1, ms) == 1 && (pfd.revents & POLLIN);
+}
+
+// reads a byte that should arrive within ms
+int editorReadWithin(char *c, int ms) {
+    int nread = editorInputByte(c);
+    if (nread == 0) {
+        struct pollfd pfd = {E.infd, POLLIN, 0};
+        if (poll(&pfd, 1, ms) == 1) {
+            nread = editorInputByte(c);
         }
     }
+    return nread;
+}
+
+// reads a byte the terminal is in the middle of sending
+int editorReadFollowing(char *c) {
+    return editorReadWithin(c, CRATE_ESC_TIMEOUT);
+}
 
+// turns the first byte of a key, plus whatever escape sequence follows it,
+// into the key
+int editorDecodeKey(char c) {
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+        if (editorReadFollowing(&seq[0]) != 1) {
             return '\x1b';
         }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if (editorReadFollowing(&seq[1]) != 1) {
             return '\x1b';
         }
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                if (editorReadFollowing(&seq[2]) != 1) {
+                    return '\x1b';
+                }
+                if (seq[2] >= '0' && seq[2] <= '9') {
+                    // three digit codes: the paste markers
+                    char d = '\0';
+                    int code = (seq[1] - '0') * 10 + seq[2] - '0';
+                    while (editorReadFollowing(&d) == 1 && d >= '0' && d <= '9') {
+                        code = code * 10 + d - '0';
+                    }
+                    if (d == '~' && code == 200) {
+                        return PASTE_START;
+                    }
                     return '\x1b';
                 }
                 if (seq[2] == '~') {
@@ -190,8 +669,29 @@ int editorReadKey() {
         return '\x1b';
     }
     else {
-        return c;
+        return (unsigned char)c;  // a UTF-8 char comes a byte at a time
+    }
+}
+
+int editorReadKey() {
+    int nread;
+    char c;
+    int hangup = 0;
+    while ((nread = editorInputByte(&c)) != 1) {
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+            die("read");
+        }
+        if (nread == 0 && (E.headless || hangup)) {
+            E.hangup = hangup;
+            exit(0);  // script played out, or the terminal went away
+        }
+        hangup = editorWaitInput();
     }
+
+    long long t = traceNow();
+    int key = editorDecodeKey(c);
+    traceSpan(TRACE_READ, 0, t);
+    return key;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -204,7 +704,7 @@ int getCursorPosition(int *rows, int *cols) {
     }
 
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+        if (editorReadFollowing(&buf[i]) != 1) {
             break;
         }
         if (buf[i] == 'R') {
@@ -244,296 +744,4745 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-/*** ---------- row operations ---------- ***/
+/*** ---------- event loop ---------- ***/
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j = 0;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (CRATE_TAB_STOP - 1) - (rx % CRATE_TAB_STOP);
+// calls fn once, ms from now, and redraws after it. A timer already
+// pending for the same fn and arg is moved rather than added again
+int editorAddTimer(int ms, void (*fn)(void *arg), void *arg) {
+    long long when = traceNow() + ms * 1000000LL;
+    int j;
+    for (j = 0; j < E.ntimers; j++) {
+        if (E.timers[j].fn == fn && E.timers[j].arg == arg) {
+            E.timers[j].when = when;
+            return 0;
         }
-        rx++;
     }
-    return rx;
+    if (E.ntimers == CRATE_MAX_TIMERS) {
+        return -1;
+    }
+    E.timers[E.ntimers++] = (struct editorTimer){when, fn, arg};
+    return 0;
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
+// ms until the next timer, -1 if nothing is due
+int editorPollTimeout() {
+    long long next = 0;
     int j;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
+    for (j = 0; j < E.ntimers; j++) {
+        if (next == 0 || E.timers[j].when < next) {
+            next = E.timers[j].when;
         }
     }
-    free(row->render);
-    row->render = malloc(row->size + tabs*(CRATE_TAB_STOP - 1) + 1);
+    if (next == 0) {
+        return -1;
+    }
+    long long wait = next - traceNow();
+    if (wait <= 0) {
+        return 0;
+    }
+    return (int)((wait + 999999) / 1000000);  // round up, never wake early
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % CRATE_TAB_STOP != 0) {
-                row->render[idx++] = ' ';
-            }
+// fires due timers, returns how many
+int editorRunTimers() {
+    long long now = traceNow();
+    int fired = 0;
+    int j = 0;
+    while (j < E.ntimers) {
+        if (E.timers[j].when <= now) {
+            struct editorTimer t = E.timers[j];
+            E.timers[j] = E.timers[--E.ntimers];
+            t.fn(t.arg);  // may add timers of its own
+            fired++;
         }
         else {
-            row->render[idx++] = row->chars[j];
+            j++;
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    return fired;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) {
+void editorHandleSignals() {
+    struct signalfd_siginfo si;
+    while (read(E.sigfd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo != SIGWINCH) {
+            E.hangup = si.ssi_signo == SIGHUP;
+            exit(1);  // hangup or kill: leave through atexit, flushing the journal
+        }
+    }
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1 || rows < 3) {
         return;
     }
+    E.screenrows = rows - 2;
+    E.screencols = cols;
+    editorFrameInit(rows);  // full repaint at the new size
+}
+
+// blocks until the terminal has input, handling resizes and timers
+// meanwhile and redrawing after them. Nothing runs while the editor
+// sits idle: no wakeups unless a timer is pending. Returns nonzero if the
+// terminal hung up
+int editorWaitInput() {
+    while (1) {
+        struct pollfd fds[2];
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){E.infd, POLLIN, 0};
+        if (E.sigfd != -1) {
+            fds[nfds++] = (struct pollfd){E.sigfd, POLLIN, 0};
+        }
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+        if (poll(fds, nfds, editorPollTimeout()) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll");
+        }
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+        int redraw = editorRunTimers();
+        if (E.sigfd != -1 && fds[1].revents) {
+            editorHandleSignals();
+            redraw = 1;
+        }
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+        if (fds[0].revents & POLLIN) {
+            return 0;
+        }
+        if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            return 1;
+        }
+        if (redraw) {
+            editorRefreshScreen();
+        }
+    }
+}
 
-    E.numrows++;
-    E.dirty++;
+// SIGWINCH, SIGHUP and SIGTERM are blocked and read from a signalfd
+// instead, so a resize or a hangup is just another fd for the event loop
+void editorInitSignals() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    E.sigfd = -1;
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == 0) {
+        E.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (E.sigfd == -1) {
+            sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        }
+    }
 }
 
+/*** ---------- row storage ---------- ***/
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
+unsigned int ropeRandom() {
+    // xorshift32 - only needs to be cheap and never return the same run twice
+    unsigned int x = E.seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    E.seed = x;
+    return x;
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) {
-        return;
+int ropeCount(rowNode *n) {
+    return n ? n->count : 0;
+}
+
+long long ropeBytes(rowNode *n) {
+    return n ? n->bytes : 0;
+}
+
+int ropeLines(rowNode *n) {
+    return n ? n->vlines : 0;
+}
+
+// where a row sits in the file if it is still there unchanged, newline and all
+char *editorRowFileLine(erow *row) {
+    if (!(row->flags & ROW_MAPPED)) {
+        return NULL;
     }
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    E.numrows--;
-    E.dirty++;
+    char *end = row->chars + row->size;
+    if (end >= E.map + E.maplen || *end != '\n') {
+        return NULL;
+    }
+    return row->chars;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) {
-        at = row->size;
+char *ropeSpan(rowNode *n) {
+    char *line = editorRowFileLine(&n->row);
+    if (line == NULL) {
+        return NULL;
     }
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+    if (n->left && (n->left->span == NULL || n->left->span + n->left->bytes != line)) {
+        return NULL;
+    }
+    if (n->right && n->right->span != line + n->row.size + 1) {
+        return NULL;
+    }
+    return n->left ? n->left->span : line;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+void ropePull(rowNode *n) {
+    n->count = 1 + ropeCount(n->left) + ropeCount(n->right);
+    n->bytes = n->row.size + 1 + ropeBytes(n->left) + ropeBytes(n->right);
+    n->span = ropeSpan(n);
+    n->vlines = n->row.lines + ropeLines(n->left) + ropeLines(n->right);
+    n->stale = n->row.cols < 0 || n->row.flags & ROW_TAIL || (n->left && n->left->stale) || (n->right && n->right->stale);
+    if (n->left) {
+        n->left->parent = n;
+    }
+    if (n->right) {
+        n->right->parent = n;
+    }
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) {
+rowNode *ropeAllocNodes(int n) {
+    // single nodes come from the free list so split/join churn does not hit
+    // malloc, spans (file load, paste) get one contiguous block
+    if (n == 1) {
+        if (E.freenodes == NULL) {
+            int j;
+            rowNode *slab = malloc(sizeof(rowNode) * 64);
+            if (slab == NULL) {
+                die("malloc");
+            }
+            for (j = 0; j < 64; j++) {
+                slab[j].right = E.freenodes;
+                E.freenodes = &slab[j];
+            }
+        }
+        rowNode *node = E.freenodes;
+        E.freenodes = node->right;
+        return node;
+    }
+
+    rowNode *nodes = malloc(sizeof(rowNode) * n);
+    if (nodes == NULL) {
+        die("malloc");
+    }
+    return nodes;
+}
+
+rowNode *editorGrowNodes(rowNode *nodes, int *nodecap, int nlines) {
+    if (nlines < *nodecap) {
+        return nodes;
+    }
+    *nodecap *= 2;
+    nodes = realloc(nodes, sizeof(rowNode) * *nodecap);
+    if (nodes == NULL) {
+        die("realloc");
+    }
+    return nodes;
+}
+
+void ropeFreeNode(rowNode *n) {
+    n->right = E.freenodes;
+    E.freenodes = n;
+}
+
+rowNode *ropeMerge(rowNode *a, rowNode *b) {
+    if (a == NULL) {
+        return b;
+    }
+    if (b == NULL) {
+        return a;
+    }
+    if (a->prio > b->prio) {
+        a->right = ropeMerge(a->right, b);
+        ropePull(a);
+        return a;
+    }
+    else {
+        b->left = ropeMerge(a, b->left);
+        ropePull(b);
+        return b;
+    }
+}
+
+// first k rows of t go to *l, the rest to *r
+void ropeSplit(rowNode *t, int k, rowNode **l, rowNode **r) {
+    if (t == NULL) {
+        *l = NULL;
+        *r = NULL;
         return;
     }
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    if (ropeCount(t->left) < k) {
+        ropeSplit(t->right, k - ropeCount(t->left) - 1, &t->right, r);
+        ropePull(t);
+        *l = t;
+    }
+    else {
+        ropeSplit(t->left, k, l, &t->left);
+        ropePull(t);
+        *r = t;
+    }
 }
 
-/*** ---------- editor operations ---------- ***/
+void ropeFixCounts(rowNode *n) {
+    if (n == NULL) {
+        return;
+    }
+    ropeFixCounts(n->left);
+    ropeFixCounts(n->right);
+    ropePull(n);
+}
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+// builds a treap over nodes[0..n) in O(n): the nodes are already in order,
+// so the cartesian tree on their priorities falls out of one pass with a
+// stack holding the current right spine
+rowNode *ropeBuild(rowNode *nodes, int n) {
+    if (n <= 0) {
+        return NULL;
+    }
+
+    int cap = 64;
+    int depth = 0;
+    rowNode **spine = malloc(sizeof(rowNode *) * cap);
+    if (spine == NULL) {
+        die("malloc");
+    }
+    int j;
+    for (j = 0; j < n; j++) {
+        rowNode *x = &nodes[j];
+        rowNode *last = NULL;
+        x->prio = ropeRandom();
+        x->right = NULL;
+        while (depth > 0 && spine[depth - 1]->prio < x->prio) {
+            last = spine[--depth];
+        }
+        x->left = last;
+        if (depth > 0) {
+            spine[depth - 1]->right = x;
+        }
+        if (depth == cap) {
+            cap *= 2;
+            spine = realloc(spine, sizeof(rowNode *) * cap);
+            if (spine == NULL) {
+                die("realloc");
+            }
+        }
+        spine[depth++] = x;
+    }
+
+    rowNode *root = spine[0];
+    free(spine);
+    ropeFixCounts(root);
+    root->parent = NULL;
+    return root;
+}
+
+void ropeSetRoot(rowNode *root) {
+    E.rows = root;
+    if (root) {
+        root->parent = NULL;
+    }
+    E.numrows = ropeCount(root);
+}
+
+// splices an already built subtree of rows in before row at
+void ropeInsertSpan(int at, rowNode *span) {
+    rowNode *l, *r;
+    ropeSplit(E.rows, at, &l, &r);
+    ropeSetRoot(ropeMerge(ropeMerge(l, span), r));
+}
+
+// cuts rows [at, at + n) out and returns them as their own tree
+rowNode *ropeRemoveSpan(int at, int n) {
+    rowNode *l, *m, *r;
+    ropeSplit(E.rows, at, &l, &r);
+    ropeSplit(r, n, &m, &r);
+    ropeSetRoot(ropeMerge(l, r));
+    if (m) {
+        m->parent = NULL;
+    }
+    return m;
+}
+
+// refreshes the aggregates above a row whose size or backing changed. Its
+// wrap layout is redone when the next frame needs it
+void ropeRowChanged(erow *row) {
+    rowNode *n;
+    row->cols = -1;
+    for (n = (rowNode *)row; n; n = n->parent) {
+        ropePull(n);
+    }
+}
+
+erow *editorRowAt(int at) {
+    if (at < 0 || at >= E.numrows) {
+        return NULL;
+    }
+    rowNode *n = E.rows;
+    while (n) {
+        int lcount = ropeCount(n->left);
+        if (at < lcount) {
+            n = n->left;
+        }
+        else if (at == lcount) {
+            return &n->row;
+        }
+        else {
+            at -= lcount + 1;
+            n = n->right;
+        }
+    }
+    return NULL;
+}
+
+// position of n among the rows under top, or in the whole tree if top is NULL
+int ropeRank(rowNode *n, rowNode *top) {
+    int at = ropeCount(n->left);
+    while (n != top && n->parent) {
+        if (n->parent->right == n) {
+            at += ropeCount(n->parent->left) + 1;
+        }
+        n = n->parent;
+    }
+    return at;
+}
+
+// the row under n holding byte off of its rows, newlines counted, with the
+// column of that byte in *col
+int ropeLocate(rowNode *n, long long off, int *col) {
+    int at = 0;
+    while (n) {
+        long long lbytes = ropeBytes(n->left);
+        if (off < lbytes) {
+            n = n->left;
+            continue;
+        }
+        off -= lbytes;
+        if (off <= n->row.size) {
+            *col = off;
+            return at + ropeCount(n->left);
+        }
+        off -= n->row.size + 1;
+        at += ropeCount(n->left) + 1;
+        n = n->right;
+    }
+    *col = 0;
+    return at;
+}
+
+// the screen lines rows [0, at) wrap to, at == E.numrows giving them all
+int ropeLinesBefore(int at) {
+    int lines = 0;
+    rowNode *n = E.rows;
+    while (n) {
+        int lcount = ropeCount(n->left);
+        if (at < lcount) {
+            n = n->left;
+            continue;
+        }
+        lines += ropeLines(n->left);
+        if (at == lcount) {
+            return lines;
+        }
+        lines += n->row.lines;
+        at -= lcount + 1;
+        n = n->right;
+    }
+    return lines;
+}
+
+// the row wrapped screen line v falls in, with which of its lines it is in
+// *k. Past the last line it is E.numrows
+int ropeLocateLine(int v, int *k) {
+    int at = 0;
+    rowNode *n = E.rows;
+    while (n) {
+        int llines = ropeLines(n->left);
+        if (v < llines) {
+            n = n->left;
+            continue;
+        }
+        v -= llines;
+        if (v < n->row.lines) {
+            *k = v;
+            return at + ropeCount(n->left);
+        }
+        v -= n->row.lines;
+        at += ropeCount(n->left) + 1;
+        n = n->right;
+    }
+    *k = 0;
+    return at;
+}
+
+// in-order successor, amortized O(1) when walking a run of rows
+erow *editorRowNext(erow *row) {
+    rowNode *n = (rowNode *)row;
+    if (n->right) {
+        n = n->right;
+        while (n->left) {
+            n = n->left;
+        }
+        return &n->row;
+    }
+    while (n->parent && n->parent->right == n) {
+        n = n->parent;
+    }
+    return n->parent ? &n->parent->row : NULL;
+}
+
+erow *editorRowPrev(erow *row) {
+    rowNode *n = (rowNode *)row;
+    if (n->left) {
+        n = n->left;
+        while (n->right) {
+            n = n->right;
+        }
+        return &n->row;
+    }
+    while (n->parent && n->parent->left == n) {
+        n = n->parent;
+    }
+    return n->parent ? &n->parent->row : NULL;
+}
+
+/*** ---------- render cache ---------- ***/
+
+void renderCacheInit() {
+    int j;
+    E.rcache = malloc(sizeof(struct renderSlot) * CRATE_RENDER_ROWS);
+    if (E.rcache == NULL) {
+        die("malloc");
+    }
+    for (j = 0; j < CRATE_RENDER_ROWS; j++) {
+        E.rcache[j].row = NULL;
+        E.rcache[j].cps = NULL;
+        E.rcache[j].ncps = 0;
+        E.rcache[j].cpcap = 0;
+        E.rcache[j].wcps = NULL;
+        E.rcache[j].nwcps = 0;
+        E.rcache[j].wcpcap = 0;
+        E.rcache[j].wcols = 0;
+        E.rcache[j].wide = -1;
+        E.rcache[j].lasttab = -1;
+        E.rcache[j].next = j + 1 < CRATE_RENDER_ROWS ? j + 1 : -1;
+    }
+    E.rfree = 0;
+    E.rhead = -1;
+    E.rtail = -1;
+    E.rbytes = 0;
+    E.rshared = 0;
+}
+
+void renderCacheUnlink(int slot) {
+    struct renderSlot *s = &E.rcache[slot];
+    if (s->prev != -1) {
+        E.rcache[s->prev].next = s->next;
+    }
+    else {
+        E.rhead = s->next;
+    }
+    if (s->next != -1) {
+        E.rcache[s->next].prev = s->prev;
+    }
+    else {
+        E.rtail = s->prev;
+    }
+}
+
+void renderCachePushFront(int slot) {
+    struct renderSlot *s = &E.rcache[slot];
+    s->prev = -1;
+    s->next = E.rhead;
+    if (E.rhead != -1) {
+        E.rcache[E.rhead].prev = slot;
+    }
+    E.rhead = slot;
+    if (E.rtail == -1) {
+        E.rtail = slot;
+    }
+}
+
+// drops whatever render a row holds; called whenever chars change and when
+// the row is freed or evicted
+void editorInvalidateRow(erow *row) {
+    if (row->rslot != -1) {
+        renderCacheUnlink(row->rslot);
+        E.rcache[row->rslot].row = NULL;
+        E.rcache[row->rslot].ncps = 0;
+        E.rcache[row->rslot].nwcps = 0;
+        E.rcache[row->rslot].next = E.rfree;
+        E.rfree = row->rslot;
+        row->rslot = -1;
+    }
+    if (row->flags & ROW_RAW) {
+        E.rshared -= row->rsize;
+        row->flags &= ~ROW_RAW;
+        row->render = NULL;
+    }
+    if (row->render) {
+        E.rbytes -= row->rcap;
+        free(row->render);
+        row->render = NULL;
+    }
+    row->rsize = 0;
+    row->rcap = 0;
+}
+
+/*** ---------- row operations ---------- ***/
+
+// the row the cursor is typing into keeps a gap at the edit point, so its
+// chars are [0, gapstart) + gap + the rest. Per-keystroke readers go through
+// these helpers; anything wanting the whole line contiguous calls
+// editorRowFlatten first
+char editorRowChar(erow *row, int at) {
+    if (row == E.gaprow && at >= E.gapstart) {
+        at += E.gaplen;
+    }
+    return row->chars[at];
+}
+
+// keeps slack past what is needed so edits grow the render in place
+void editorRowRenderReserve(erow *row, int need) {
+    if (need <= row->rcap) {
+        return;
+    }
+    int cap = need + need / 4 + 16;
+    char *render = realloc(row->render, cap);
+    if (render == NULL) {
+        die("realloc");
+    }
+    E.rbytes += cap - row->rcap;
+    row->render = render;
+    row->rcap = cap;
+}
+
+int editorNextRx(int rx, char c) {
+    if (c == '\t') {
+        return (rx / CRATE_TAB_STOP + 1) * CRATE_TAB_STOP;
+    }
+    return rx + 1;
+}
+
+// whether none of s[0..len) has its top bit set. Rows that pass keep every
+// byte a column; only the others pay for decoding
+int editorAsciiScalar(const char *s, long len) {
+    long i = 0;
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long w;
+        memcpy(&w, s + i, 8);
+        if (w & 0x8080808080808080ULL) {
+            return 0;
+        }
+    }
+    for (; i < len; i++) {
+        if (s[i] & 0x80) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+int editorAsciiSSE2(const char *s, long len) {
+    long i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + i)),
+                                 _mm_loadu_si128((const __m128i *)(s + i + 16)));
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + i + 32)),
+                                 _mm_loadu_si128((const __m128i *)(s + i + 48)));
+        if (_mm_movemask_epi8(_mm_or_si128(a, b))) {
+            return 0;
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)))) {
+            return 0;
+        }
+    }
+    return editorAsciiScalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+int editorAsciiAVX2(const char *s, long len) {
+    long i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(s + i)),
+                                    _mm256_loadu_si256((const __m256i *)(s + i + 32)));
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(s + i + 64)),
+                                    _mm256_loadu_si256((const __m256i *)(s + i + 96)));
+        if (_mm256_movemask_epi8(_mm256_or_si256(a, b))) {
+            return 0;
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)))) {
+            return 0;
+        }
+    }
+    return editorAsciiScalar(s + i, len - i);
+}
+#endif
+
+int editorIsAscii(const char *s, long len) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        return editorAsciiAVX2(s, len);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return editorAsciiSSE2(s, len);
+    }
+#endif
+    return editorAsciiScalar(s, len);
+}
+
+// classifies a row the first time it is asked and keeps the answer in its
+// flags until its chars change
+int editorRowIsAscii(erow *row) {
+    if (!(row->flags & (ROW_ASCII | ROW_UTF8))) {
+        int ascii;
+        if (row == E.gaprow) {
+            ascii = editorIsAscii(row->chars, E.gapstart) &&
+                    editorIsAscii(row->chars + E.gapstart + E.gaplen, row->size - E.gapstart);
+        }
+        else {
+            ascii = editorIsAscii(row->chars, row->size);
+        }
+        row->flags |= ascii ? ROW_ASCII : ROW_UTF8;
+    }
+    return (row->flags & ROW_ASCII) != 0;
+}
+
+// the char at chars[j]: returns how many bytes it takes and sets *cols to
+// the columns it covers when it starts at column rx. Tabs run to the next
+// stop. A byte that does not start a valid, printable UTF-8 sequence is a
+// char of its own, one column wide and drawn as '?'
+int editorRowDecode(erow *row, int j, int rx, int *cols) {
+    unsigned char c = editorRowChar(row, j);
+    *cols = 1;
+    if (c < 0x80) {
+        if (c == '\t') {
+            *cols = editorNextRx(rx, c) - rx;
+        }
+        return 1;
+    }
+    int len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+    if (len == 1 || c > 0xf4 || j + len > row->size) {
+        return 1;
+    }
+    unsigned int cp = c & (0x7f >> len);
+    int k;
+    for (k = 1; k < len; k++) {
+        unsigned char b = editorRowChar(row, j + k);
+        if ((b & 0xc0) != 0x80) {
+            return 1;
+        }
+        cp = cp << 6 | (b & 0x3f);
+    }
+    // overlong forms and surrogates are not UTF-8 either
+    static const unsigned int least[5] = {0, 0, 0x80, 0x800, 0x10000};
+    if (cp < least[len] || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+        return 1;
+    }
+    int w = wcwidth(cp);
+    if (w < 0) {
+        return 1;
+    }
+    *cols = w;
+    return len;
+}
+
+// whether the char at chars[j] is a mark that joins the one before it,
+// like a combining accent: the cursor never stops in front of one
+int editorRowJoins(erow *row, int j) {
+    int w;
+    editorRowDecode(row, j, 0, &w);
+    return w == 0;
+}
+
+// the start of the char that ends at cx. Its lead byte is at most three
+// bytes back; if what starts there does not end at cx, the byte before cx
+// stands alone
+int editorRowPrevChar(erow *row, int cx) {
+    int s = cx - 1;
+    while (s > 0 && s > cx - 4 && (editorRowChar(row, s) & 0xc0) == 0x80) {
+        s--;
+    }
+    int w;
+    return s + editorRowDecode(row, s, 0, &w) == cx ? s : cx - 1;
+}
+
+// where the cursor goes moving left from cx, one grapheme (a char and the
+// marks joined to it) at a time
+int editorRowPrevGrapheme(erow *row, int cx) {
+    if (editorRowIsAscii(row)) {
+        return cx - 1;
+    }
+    do {
+        cx = editorRowPrevChar(row, cx);
+    } while (cx > 0 && editorRowJoins(row, cx));
+    return cx;
+}
+
+// and moving right
+int editorRowNextGrapheme(erow *row, int cx) {
+    if (editorRowIsAscii(row)) {
+        return cx + 1;
+    }
+    int w;
+    cx += editorRowDecode(row, cx, 0, &w);
+    while (cx < row->size && editorRowJoins(row, cx)) {
+        cx += editorRowDecode(row, cx, 0, &w);
+    }
+    return cx;
+}
+
+// the first char to start at or after p. A continuation byte is part of
+// a char only if one starting up to three bytes back runs over it
+int editorRowBoundary(erow *row, int p) {
+    if (editorRowIsAscii(row) || p >= row->size || (editorRowChar(row, p) & 0xc0) != 0x80) {
+        return p;
+    }
+    int s;
+    for (s = p - 1; s >= 0 && s >= p - 3; s--) {
+        if ((editorRowChar(row, s) & 0xc0) != 0x80) {
+            int w;
+            int end = s + editorRowDecode(row, s, 0, &w);
+            return end > p ? end : p;
+        }
+    }
+    return p;
+}
+
+// walks the chars [*j, end) of row from column rx, returning the column
+// after them. Chars that are not ASCII may run a little past end
+int editorRowWalk(erow *row, int *j, int end, int rx) {
+    if (row->flags & ROW_ASCII) {
+        for (; *j < end; (*j)++) {
+            rx = editorNextRx(rx, editorRowChar(row, *j));
+        }
+        return rx;
+    }
+    while (*j < end) {
+        int w;
+        *j += editorRowDecode(row, *j, rx, &w);
+        rx += w;
+    }
+    return rx;
+}
+
+// cached rows remember the rx of every CRATE_RX_CHECKPOINT-th char, so
+// converting between cx and rx only walks the chars since the nearest one.
+// In a row that is not ASCII a checkpoint is on the first char starting at
+// or after its byte. Checkpoints are filled in on demand and dropped from
+// the edit point on
+void editorRowCheckpoints(erow *row, int upto) {
+    struct renderSlot *slot = &E.rcache[row->rslot];
+    if (upto < slot->ncps) {
+        return;
+    }
+    if (upto >= slot->cpcap) {
+        slot->cpcap = upto + 1 > slot->cpcap * 2 ? upto + 1 : slot->cpcap * 2;
+        slot->cps = realloc(slot->cps, sizeof(int) * slot->cpcap);
+        if (slot->cps == NULL) {
+            die("realloc");
+        }
+    }
+    if (slot->ncps == 0) {
+        slot->cps[slot->ncps++] = 0;
+    }
+
+    int j = editorRowBoundary(row, (slot->ncps - 1) * CRATE_RX_CHECKPOINT);
+    int rx = slot->cps[slot->ncps - 1];
+    while (slot->ncps <= upto) {
+        rx = editorRowWalk(row, &j, slot->ncps * CRATE_RX_CHECKPOINT, rx);
+        slot->cps[slot->ncps++] = rx;
+    }
+}
+
+void editorRowTrimCheckpoints(erow *row, int at) {
+    if (row->rslot == -1) {
+        return;
+    }
+    // whether a byte starts a char can hang on the few bytes after it
+    if (!(row->flags & ROW_ASCII)) {
+        at -= 6;
+    }
+    struct renderSlot *slot = &E.rcache[row->rslot];
+    int keep = (at > 0 ? at : 0) / CRATE_RX_CHECKPOINT + 1;
+    if (slot->ncps > keep) {
+        slot->ncps = keep;
+    }
+    if (slot->nwcps > keep) {
+        slot->nwcps = keep;
+    }
+}
+
+// takes a free slot in the render cache for row
+void editorRowTakeSlot(erow *row) {
+    row->rslot = E.rfree;
+    E.rfree = E.rcache[row->rslot].next;
+    E.rcache[row->rslot].row = row;
+    E.rcache[row->rslot].wide = -1;
+    E.rcache[row->rslot].lasttab = -1;
+    renderCachePushFront(row->rslot);
+}
+
+// long rows that are not ASCII have no render, but still keep checkpoints
+// in a cache slot of their own
+void editorRowKeepCheckpoints(erow *row) {
+    if (row->rslot != -1 || row->size < CRATE_RX_CHECKPOINT || editorRowIsAscii(row)) {
+        return;
+    }
+    while (E.rfree == -1 && E.rtail != -1) {
+        editorInvalidateRow(E.rcache[E.rtail].row);
+    }
+    editorRowTakeSlot(row);
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+    if (row->flags & ROW_RAW) {
+        return cx;
+    }
+    editorRowIsAscii(row);
+    editorRowKeepCheckpoints(row);
+    int rx = 0;
+    int j = 0;
+    if (row->rslot != -1) {
+        int cp = cx / CRATE_RX_CHECKPOINT;
+        editorRowCheckpoints(row, cp);
+        j = editorRowBoundary(row, cp * CRATE_RX_CHECKPOINT);
+        rx = E.rcache[row->rslot].cps[cp];
+    }
+    return editorRowWalk(row, &j, cx, rx);
+}
+
+// the last checkpoint at or before column rx: returns its char and sets
+// *at to its column. Checkpoints are only filled in until one passes rx
+int editorRowSeekRx(erow *row, int rx, int *at) {
+    editorRowIsAscii(row);
+    editorRowKeepCheckpoints(row);
+    *at = 0;
+    if (row->rslot == -1) {
+        return 0;
+    }
+    struct renderSlot *slot = &E.rcache[row->rslot];
+    editorRowCheckpoints(row, 0);
+    while (slot->ncps <= row->size / CRATE_RX_CHECKPOINT && slot->cps[slot->ncps - 1] <= rx) {
+        editorRowCheckpoints(row, slot->ncps);
+    }
+    int lo = 0;
+    int hi = slot->ncps - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (slot->cps[mid] <= rx) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    *at = slot->cps[lo];
+    return editorRowBoundary(row, lo * CRATE_RX_CHECKPOINT);
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+    if (row->flags & ROW_RAW) {
+        return rx < row->size ? rx : row->size;
+    }
+    int cur_rx;
+    int cx = editorRowSeekRx(row, rx, &cur_rx);
+    // the char covering column rx, or the row end if none does
+    while (cx < row->size) {
+        int next = cx;
+        cur_rx = editorRowWalk(row, &next, cx + 1, cur_rx);
+        if (cur_rx > rx) {
+            return cx;
+        }
+        cx = next;
+    }
+    return cx;
+}
+
+void editorUpdateRow(erow *row) {
+    int tabs = 0;
+    int j;
+    for (j = 0; j < row->size; j++) {
+        if (editorRowChar(row, j) == '\t') {
+            tabs++;
+        }
+    }
+    editorRowRenderReserve(row, row->size + tabs*(CRATE_TAB_STOP - 1) + 1);
+
+    int idx = 0;
+    for (j = 0; j < row->size; j++) {
+        char c = editorRowChar(row, j);
+        if (c == '\t') {
+            row->render[idx++] = ' ';
+            while (idx % CRATE_TAB_STOP != 0) {
+                row->render[idx++] = ' ';
+            }
+        }
+        else {
+            row->render[idx++] = c;
+        }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+}
+
+int editorRowNeedsExpansion(erow *row) {
+    if (row == E.gaprow) {
+        return memchr(row->chars, '\t', E.gapstart) != NULL ||
+               memchr(row->chars + E.gapstart + E.gaplen, '\t', row->size - E.gapstart) != NULL;
+    }
+    return memchr(row->chars, '\t', row->size) != NULL;
+}
+
+// the render of a row about to be drawn, built now if it is not cached. Makes
+// room by evicting the least recently drawn rows
+char *editorRowRender(erow *row) {
+    if (row->flags & ROW_RAW) {
+        return row->render;
+    }
+    if (row->render) {
+        renderCacheUnlink(row->rslot);
+        renderCachePushFront(row->rslot);
+        return row->render;
+    }
+    editorInvalidateRow(row);  // checkpoints kept from when it was not ASCII
+
+    // rows that would render byte for byte as they are just alias chars:
+    // no copy, no cache slot, nothing to evict
+    if (!editorRowNeedsExpansion(row)) {
+        row->flags |= ROW_RAW;
+        row->render = row->chars;
+        row->rsize = row->size;
+        E.rshared += row->rsize;
+        return row->render;
+    }
+
+    while ((E.rfree == -1 || E.rbytes > CRATE_RENDER_BYTES) && E.rtail != -1) {
+        editorInvalidateRow(E.rcache[E.rtail].row);
+    }
+    editorUpdateRow(row);
+    editorRowTakeSlot(row);
+    return row->render;
+}
+
+void editorInitRow(erow *row, char *s, size_t len) {
+    row->size = len;
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->flags = 0;
+    row->cols = -1;
+    row->lines = 1;
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->rcap = 0;
+    row->rslot = -1;
+}
+
+// patches a cached render after the char c was inserted at (or deleted
+// from) at rather than throwing it away. Only chars from the edit up to the
+// first tab that realigns the old and new columns are expanded again; the
+// rest of the render is moved over as it is
+void editorRowRenderEdit(erow *row, int at, char c, int inserted) {
+    if (row->render == NULL) {
+        editorRowTrimCheckpoints(row, at);
+        return;  // nothing cached, it is built when the row is drawn
+    }
+    if (c & 0x80) {
+        editorInvalidateRow(row);  // rows that are not ASCII draw from chars
+        return;
+    }
+    if (row->flags & ROW_RAW) {
+        if (c == '\t') {
+            editorInvalidateRow(row);
+            return;
+        }
+        row->rsize += inserted ? 1 : -1;
+        E.rshared += inserted ? 1 : -1;
+        return;
+    }
+
+    editorRowTrimCheckpoints(row, at);
+
+    int rx0;
+    if (!inserted && at == row->size && c != '\t') {
+        row->rsize--;  // last char went away
+        row->render[row->rsize] = '\0';
+        return;
+    }
+    else if (inserted && at == row->size - 1) {
+        rx0 = row->rsize;  // appended at the end
+    }
+    else {
+        rx0 = editorRowCxToRx(row, at);
+    }
+
+    int oldrx = rx0;
+    int newrx = rx0;
+    if (inserted) {
+        newrx = editorNextRx(newrx, c);
+    }
+    else {
+        oldrx = editorNextRx(oldrx, c);
+    }
+    int j = inserted ? at + 1 : at;
+    while (j < row->size && oldrx != newrx) {
+        char ch = editorRowChar(row, j);
+        oldrx = editorNextRx(oldrx, ch);
+        newrx = editorNextRx(newrx, ch);
+        j++;
+    }
+
+    int tail = row->rsize - oldrx;
+    editorRowRenderReserve(row, newrx + tail + 1);
+    memmove(&row->render[newrx], &row->render[oldrx], tail + 1);
+
+    int idx = rx0;
+    int i;
+    for (i = at; i < j; i++) {
+        char ch = editorRowChar(row, i);
+        int next = editorNextRx(idx, ch);
+        while (idx < next) {
+            row->render[idx++] = ch == '\t' ? ' ' : ch;
+        }
+    }
+    row->rsize = newrx + tail;
+}
+
+// gives a row that still points into the file mapping its own heap copy,
+// which has to happen before anything writes to chars
+void editorRowMaterialize(erow *row) {
+    if (!(row->flags & ROW_MAPPED)) {
+        return;
+    }
+    char *chars = malloc(row->size + 1);
+    if (chars == NULL) {
+        die("malloc");
+    }
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+    row->flags &= ~ROW_MAPPED;
+    if (row->flags & ROW_RAW) {
+        row->render = chars;
+    }
+    ropeRowChanged(row);
+}
+
+// closes the gap of the row being edited, making its chars contiguous again
+void editorGapClose() {
+    erow *row = E.gaprow;
+    if (row == NULL) {
+        return;
+    }
+    memmove(&row->chars[E.gapstart], &row->chars[E.gapstart + E.gaplen],
+            row->size - E.gapstart);
+    row->chars[row->size] = '\0';
+    E.gaprow = NULL;
+}
+
+void editorRowFlatten(erow *row) {
+    if (row == E.gaprow) {
+        editorGapClose();
+    }
+}
+
+// makes row the gap row with its gap at at and at least one free byte in it.
+// The buffer is always size + gaplen + 1 long so closing has room for '\0'
+void editorRowGapAt(erow *row, int at) {
+    if (row != E.gaprow) {
+        editorGapClose();
+        editorRowMaterialize(row);
+        row->chars = realloc(row->chars, row->size + CRATE_GAP_MIN + 1);
+        if (row->chars == NULL) {
+            die("realloc");
+        }
+        memmove(&row->chars[at + CRATE_GAP_MIN], &row->chars[at], row->size - at);
+        E.gaprow = row;
+        E.gapstart = at;
+        E.gaplen = CRATE_GAP_MIN;
+    }
+    else if (at < E.gapstart) {
+        memmove(&row->chars[at + E.gaplen], &row->chars[at], E.gapstart - at);
+        E.gapstart = at;
+    }
+    else if (at > E.gapstart) {
+        memmove(&row->chars[E.gapstart], &row->chars[E.gapstart + E.gaplen], at - E.gapstart);
+        E.gapstart = at;
+    }
+
+    if (E.gaplen == 0) {
+        // grow with the line so a long run of typing stays amortized O(1)
+        int grow = row->size / 2 > CRATE_GAP_MIN ? row->size / 2 : CRATE_GAP_MIN;
+        row->chars = realloc(row->chars, row->size + grow + 1);
+        if (row->chars == NULL) {
+            die("realloc");
+        }
+        memmove(&row->chars[at + grow], &row->chars[at], row->size - at);
+        E.gaplen = grow;
+    }
+    if (row->flags & ROW_RAW) {
+        row->render = row->chars;
+    }
+}
+
+// the gap only lives while the cursor stays on its row
+void editorGapFollowCursor() {
+    if (E.gaprow && E.gaprow != editorRowAt(E.cy)) {
+        editorGapClose();
+    }
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows) {
+        return;
+    }
+
+    rowNode *node = ropeAllocNodes(1);
+    node->left = NULL;
+    node->right = NULL;
+    node->prio = ropeRandom();
+    editorInitRow(&node->row, s, len);
+    ropePull(node);
+    ropeInsertSpan(at, node);
+    syntaxInvalidate(at);
+
+    E.dirty++;
+}
+
+
+void editorFreeRow(erow *row) {
+    if (row == E.gaprow) {
+        E.gaprow = NULL;
+    }
+    editorInvalidateRow(row);
+    if (!(row->flags & ROW_MAPPED)) {
+        free(row->chars);
+    }
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows) {
+        return;
+    }
+    rowNode *node = ropeRemoveSpan(at, 1);
+    editorFreeRow(&node->row);
+    ropeFreeNode(node);
+    syntaxInvalidate(at);
+    E.dirty++;
+}
+
+// frees a subtree cut out with ropeRemoveSpan
+void editorFreeRows(rowNode *n) {
+    if (n == NULL) {
+        return;
+    }
+    editorFreeRows(n->left);
+    editorFreeRows(n->right);
+    editorFreeRow(&n->row);
+    ropeFreeNode(n);
+}
+
+// whatever was worked out from the chars of row no longer holds. Single
+// byte edits keep what they can instead
+void editorRowChanged(erow *row) {
+    row->flags &= ~(ROW_ASCII | ROW_UTF8);
+    syntaxRowChanged(row);
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+    struct layoutEdit le;
+    editorRowLayoutBefore(row, at, c, 1, &le);
+    editorRowGapAt(row, at);
+    row->chars[E.gapstart++] = c;
+    E.gaplen--;
+    row->size++;
+    ropeRowChanged(row);
+    syntaxRowChanged(row);
+    if (c & 0x80) {
+        row->flags = (row->flags & ~ROW_ASCII) | ROW_UTF8;
+    }
+    editorRowRenderEdit(row, at, c, 1);
+    editorRowLayoutAfter(row, at, c, 1, &le);
+    E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowFlatten(row);
+    editorRowMaterialize(row);
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    ropeRowChanged(row);
+    editorRowChanged(row);
+    editorInvalidateRow(row);
+    E.dirty++;
+}
+
+// hands the row chars to keep in place of its own. The tree above it is left
+// for the caller to fix, so a batch of rows can share one pass
+void editorRowSetChars(erow *row, char *chars, int size) {
+    if (row == E.gaprow) {
+        E.gaprow = NULL;
+    }
+    editorInvalidateRow(row);
+    if (!(row->flags & ROW_MAPPED)) {
+        free(row->chars);
+    }
+    row->chars = chars;
+    row->size = size;
+    row->flags &= ~(ROW_MAPPED | ROW_HL | ROW_ASCII | ROW_UTF8);
+    row->cols = -1;
+    E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+    if (at < 0 || at >= row->size) {
+        return;
+    }
+    struct layoutEdit le;
+    editorRowLayoutBefore(row, at, editorRowChar(row, at), 0, &le);
+    editorRowGapAt(row, at);
+    char c = row->chars[E.gapstart + E.gaplen];
+    E.gaplen++;
+    row->size--;
+    ropeRowChanged(row);
+    syntaxRowChanged(row);
+    if (c & 0x80) {
+        row->flags &= ~ROW_UTF8;  // may have been the last one
+    }
+    editorRowRenderEdit(row, at, c, 0);
+    editorRowLayoutAfter(row, at, c, 0, &le);
+    E.dirty++;
+}
+
+/*** ---------- editor operations ---------- ***/
+
+void editorInsertChar(int c) {
+    int kind = E.cy == E.numrows ? UNDO_APPEND : UNDO_INSERT;
+    int y = E.cy, x = E.cx;
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+    char ch = c;
+    undoRecord(kind, y, x, E.cy, E.cx, &ch, 1);
+}
+
+void editorInsertNewline() {
+    int kind = E.cy == E.numrows ? UNDO_APPEND : UNDO_INSERT;
+    int y = E.cy, x = E.cx;
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    }
+    else {
+        erow *row = editorRowAt(E.cy);
+        editorRowFlatten(row);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        row->size = E.cx;
+        // a mapped row keeps pointing at the file, it just got shorter
+        if (!(row->flags & ROW_MAPPED)) {
+            row->chars[row->size] = '\0';
+        }
+        ropeRowChanged(row);
+        editorRowChanged(row);
+        editorInvalidateRow(row);
+    }
+    E.cy++;
+    E.cx = 0;
+    undoRecord(kind, y, x, E.cy, E.cx, "\n", 1);
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) {
+        return;
+    }
+    if (E.cx == 0 && E.cy == 0) {
+        return;
+    }
+
+    erow *row = editorRowAt(E.cy);
+    int y = E.cy, x = E.cx;
+    if (E.cx > 0) {
+        // a whole grapheme goes, a byte at a time from its end so typing
+        // undo joins them into one step
+        int at = editorRowPrevGrapheme(row, E.cx);
+        while (E.cx > at) {
+            char c = editorRowChar(row, E.cx - 1);
+            editorRowDelChar(row, E.cx - 1);
+            E.cx--;
+            undoRecord(UNDO_DELETE, E.cy, E.cx, y, E.cx + 1, &c, 1);
+        }
+    }
+    else {
+        erow *prev = editorRowAt(E.cy - 1);
+        editorRowFlatten(row);
+        E.cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+        undoRecord(UNDO_DELETE, E.cy, E.cx, y, x, "\n", 1);
+    }
+}
+
+int editorIsBreak(char c, int cr) {
+    return c == '\n' || (cr && c == '\r');
+}
+
+// inserts text at the cursor as one block. Its lines are split out in a
+// single pass and spliced into the tree together, instead of arriving one
+// char and one newline at a time. \n ends a line, and with cr so do \r\n
+// and \r
+void editorInsertBlock(const char *s, size_t len, int cr) {
+    if (len == 0) {
+        return;
+    }
+    int appended = E.cy == E.numrows;
+    if (appended) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    erow *row = editorRowAt(E.cy);
+    editorRowFlatten(row);
+    editorRowMaterialize(row);
+
+    // the first line goes into the cursor row, every later one is a new row
+    size_t i = 0;
+    while (i < len && !editorIsBreak(s[i], cr)) {
+        i++;
+    }
+    size_t first = i;
+    int breaksonly = first == 0;
+
+    int nodecap = 64;
+    int nlines = 0;
+    rowNode *nodes = NULL;
+    while (i < len) {
+        if (cr && s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') {
+            i++;
+        }
+        size_t start = ++i;
+        while (i < len && !editorIsBreak(s[i], cr)) {
+            i++;
+        }
+        if (i > start) {
+            breaksonly = 0;
+        }
+        if (nodes == NULL) {
+            nodes = malloc(sizeof(rowNode) * nodecap);
+            if (nodes == NULL) {
+                die("malloc");
+            }
+        }
+        nodes = editorGrowNodes(nodes, &nodecap, nlines);
+        editorInitRow(&nodes[nlines++].row, (char *)s + start, i - start);
+    }
+
+    // past the last row Enter on its own adds a line above the cursor and
+    // leaves it past the last row, so nothing but line breaks leaves one
+    // fewer row than usual
+    int skipped = 0;
+    if (appended && breaksonly && nlines > 0) {
+        free(nodes[--nlines].row.chars);
+        skipped = 1;
+    }
+
+    int cx = skipped ? 0 : E.cx + first;
+    if (nlines > 0 && !skipped) {
+        // what followed the cursor ends up after the last pasted line
+        erow *last = &nodes[nlines - 1].row;
+        int tail = row->size - E.cx;
+        cx = last->size;
+        last->chars = realloc(last->chars, last->size + tail + 1);
+        if (last->chars == NULL) {
+            die("realloc");
+        }
+        memcpy(&last->chars[last->size], &row->chars[E.cx], tail);
+        last->size += tail;
+        last->chars[last->size] = '\0';
+        row->size = E.cx;
+    }
+
+    row->chars = realloc(row->chars, row->size + first + 1);
+    if (row->chars == NULL) {
+        die("realloc");
+    }
+    memmove(&row->chars[E.cx + first], &row->chars[E.cx], row->size - E.cx);
+    memcpy(&row->chars[E.cx], s, first);
+    row->size += first;
+    row->chars[row->size] = '\0';
+    ropeRowChanged(row);
+    editorRowChanged(row);
+    editorInvalidateRow(row);
+
+    if (nlines > 0) {
+        nodes = realloc(nodes, sizeof(rowNode) * nlines);
+        ropeInsertSpan(E.cy + 1, ropeBuild(nodes, nlines));
+    }
+    else {
+        free(nodes);
+    }
+    E.cy += nlines + skipped;
+    E.cx = cx;
+    E.dirty++;
+}
+
+void editorInsertText(const char *s, size_t len) {
+    int kind = E.cy == E.numrows ? UNDO_APPEND : UNDO_INSERT;
+    int y = E.cy, x = E.cx;
+    editorInsertBlock(s, len, 1);
+    if (len > 0) {
+        undoRecord(kind, y, x, E.cy, E.cx, s, len);
+    }
+}
+
+// sets every row a replace record lists to its new chars, or back to its old
+// ones. The record holds, per row in order, its index and the old and new
+// lengths as ints, then the old chars and the new
+void editorReplaceRows(const char *rec, size_t len, int backwards) {
+    int h[3];
+    size_t at;
+    int changed = 0;
+    for (at = 0; at + sizeof(h) <= len; at += sizeof(h) + h[1] + h[2]) {
+        memcpy(h, rec + at, sizeof(h));
+        changed++;
+    }
+    // past a few rows one pass over the whole tree beats fixing every path
+    int batch = changed > E.numrows / 16;
+
+    erow *row = NULL;
+    int y = 0;
+    for (at = 0; at + sizeof(h) <= len; at += sizeof(h) + h[1] + h[2]) {
+        memcpy(h, rec + at, sizeof(h));
+        if (row == NULL) {
+            syntaxInvalidate(h[0]);
+        }
+        if (row && h[0] > y && h[0] - y < 64) {
+            while (y < h[0]) {
+                row = editorRowNext(row);
+                y++;
+            }
+        }
+        else {
+            row = editorRowAt(h[0]);
+            y = h[0];
+        }
+        int size = backwards ? h[1] : h[2];
+        char *chars = malloc(size + 1);
+        if (chars == NULL) {
+            die("malloc");
+        }
+        memcpy(chars, rec + at + sizeof(h) + (backwards ? 0 : h[1]), size);
+        chars[size] = '\0';
+        editorRowSetChars(row, chars, size);
+        if (!batch) {
+            ropeRowChanged(row);
+        }
+    }
+    if (batch) {
+        ropeFixCounts(E.rows);
+    }
+    row = editorRowAt(E.cy);
+    if (row && E.cx > row->size) {
+        E.cx = row->size;
+    }
+}
+
+// removes the text from (y, x) up to (ey, ex), joining the two rows. Past
+// the last row ey stands for the empty line the cursor can sit on there
+void editorDeleteRange(int y, int x, int ey, int ex) {
+    erow *row = editorRowAt(y);
+    if (row == NULL) {
+        return;
+    }
+    editorRowFlatten(row);
+    editorRowMaterialize(row);
+    if (ey == y) {
+        memmove(&row->chars[x], &row->chars[ex], row->size - ex + 1);
+        row->size -= ex - x;
+    }
+    else {
+        erow *last = editorRowAt(ey);
+        int tail = 0;
+        if (last) {
+            editorRowFlatten(last);
+            tail = last->size - ex;
+        }
+        row->chars = realloc(row->chars, x + tail + 1);
+        if (row->chars == NULL) {
+            die("realloc");
+        }
+        if (last) {
+            memcpy(&row->chars[x], &last->chars[ex], tail);
+        }
+        row->size = x + tail;
+        row->chars[row->size] = '\0';
+        int end = ey < E.numrows ? ey : E.numrows - 1;
+        editorFreeRows(ropeRemoveSpan(y + 1, end - y));
+    }
+    ropeRowChanged(row);
+    editorRowChanged(row);
+    editorInvalidateRow(row);
+    E.dirty++;
+}
+
+/*** ---------- undo ---------- ***/
+
+size_t undoCost(struct undoOp *op) {
+    return sizeof(*op) + op->len;
+}
+
+void undoClear(struct undoStack *st) {
+    int j;
+    for (j = 0; j < st->n; j++) {
+        free(st->ops[st->first + j].text);
+    }
+    st->first = 0;
+    st->n = 0;
+    st->bytes = 0;
+    st->nspilled = 0;
+    st->spillend = 0;
+    if (st->spill) {
+        ftruncate(fileno(st->spill), 0);
+    }
+}
+
+// moves the oldest op held in memory to the end of the spill file: its text
+// first and the record after it, so both can be found from the end again.
+// If that fails the spilled history is dropped along with the op
+void undoSpillOldest(struct undoStack *st) {
+    struct undoOp *op = &st->ops[st->first];
+    if (st->spill == NULL) {
+        st->spill = tmpfile();
+    }
+    int fd = st->spill ? fileno(st->spill) : -1;
+    if (fd != -1 &&
+        pwrite(fd, op->text, op->len, st->spillend) == (ssize_t)op->len &&
+        pwrite(fd, op, sizeof(*op), st->spillend + op->len) == (ssize_t)sizeof(*op)) {
+        st->spillend += op->len + sizeof(*op);
+        st->nspilled++;
+    }
+    else {
+        editorSetStatusMessage("Undo history cut short: %s", strerror(errno));
+        st->nspilled = 0;
+        st->spillend = 0;
+    }
+    st->bytes -= undoCost(op);
+    free(op->text);
+    st->first++;
+    st->n--;
+}
+
+// reads the newest spilled op back, 0 if there is none left to read
+int undoUnspill(struct undoStack *st, struct undoOp *op) {
+    if (st->nspilled == 0) {
+        return 0;
+    }
+    int fd = fileno(st->spill);
+    off_t at = st->spillend - sizeof(*op);
+    if (pread(fd, op, sizeof(*op), at) == (ssize_t)sizeof(*op)) {
+        op->text = malloc(op->len + 1);
+        if (op->text == NULL) {
+            die("malloc");
+        }
+        if (pread(fd, op->text, op->len, at - op->len) == (ssize_t)op->len) {
+            op->text[op->len] = '\0';
+            st->spillend = at - op->len;
+            st->nspilled--;
+            return 1;
+        }
+        free(op->text);
+    }
+    editorSetStatusMessage("Undo history lost: %s", strerror(errno));
+    st->nspilled = 0;
+    st->spillend = 0;
+    return 0;
+}
+
+// keeps the journal within its budget, giving up undo history before redo
+// history and never the top of either stack
+void undoTrim() {
+    while (U.undo.bytes + U.redo.bytes > U.budget && U.undo.n > 1) {
+        undoSpillOldest(&U.undo);
+    }
+    while (U.undo.bytes + U.redo.bytes > U.budget && U.redo.n > 1) {
+        undoSpillOldest(&U.redo);
+    }
+}
+
+void undoPush(struct undoStack *st, struct undoOp *op) {
+    if (st->first + st->n == st->cap) {
+        if (st->first > 0 && st->first >= st->n) {
+            memmove(st->ops, &st->ops[st->first], sizeof(*op) * st->n);
+            st->first = 0;
+        }
+        else {
+            st->cap = st->cap ? st->cap * 2 : 64;
+            st->ops = realloc(st->ops, sizeof(*op) * st->cap);
+            if (st->ops == NULL) {
+                die("realloc");
+            }
+        }
+    }
+    st->ops[st->first + st->n++] = *op;
+    st->bytes += undoCost(op);
+    undoTrim();
+}
+
+int undoPop(struct undoStack *st, struct undoOp *op) {
+    if (st->n == 0) {
+        st->first = 0;
+        return undoUnspill(st, op);
+    }
+    *op = st->ops[st->first + --st->n];
+    st->bytes -= undoCost(op);
+    return 1;
+}
+
+// adds a typed char to the text of op, in front of it when backspacing
+void undoJoin(struct undoOp *op, char c, int front) {
+    op->text = realloc(op->text, op->len + 2);
+    if (op->text == NULL) {
+        die("realloc");
+    }
+    if (front) {
+        memmove(&op->text[1], op->text, op->len);
+        op->text[0] = c;
+    }
+    else {
+        op->text[op->len] = c;
+    }
+    op->len++;
+    op->text[op->len] = '\0';
+    U.undo.bytes++;
+}
+
+// called by the editor operations after every edit. A run of typing,
+// backspacing or deleting at the same spot grows the step on top instead
+// of starting a new one
+void undoRecord(int kind, int y, int x, int ey, int ex, const char *s, size_t len) {
+    long long now = traceNow();
+    int typed = len == 1 && s[0] != '\n' && s[0] != '\r';
+    struct undoOp *top = U.undo.n ? &U.undo.ops[U.undo.first + U.undo.n - 1] : NULL;
+    if (typed && top && top->typed && !U.sealed &&
+        now - top->when < CRATE_UNDO_GROUP_MS * 1000000LL) {
+        int del = kind == UNDO_DELETE;
+        int joined = 1;
+        if (!del && top->kind != UNDO_DELETE && y == top->ey && x == top->ex) {
+            undoJoin(top, s[0], 0);
+            top->ey = ey;
+            top->ex = ex;
+        }
+        else if (del && top->kind == UNDO_DELETE && ey == top->y && ex == top->x) {
+            undoJoin(top, s[0], 1);
+            top->y = y;
+            top->x = x;
+        }
+        else if (del && top->kind == UNDO_DELETE && y == top->y && x == top->x) {
+            undoJoin(top, s[0], 0);
+            top->ex++;
+        }
+        else {
+            joined = 0;
+        }
+        if (joined) {
+            top->when = now;
+            swapRecord(kind, 0, y, x, ey, ex, s, 1);
+            return;
+        }
+    }
+
+    // lines end in \n alone from here on
+    char *text = malloc(len + 1);
+    if (text == NULL) {
+        die("malloc");
+    }
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (s[i] != '\r') {
+            text[n++] = s[i];
+        }
+        else if (i + 1 == len || s[i + 1] != '\n') {
+            text[n++] = '\n';
+        }
+    }
+    text[n] = '\0';
+    swapRecord(kind, 0, y, x, ey, ex, text, n);
+
+    undoClear(&U.redo);
+    struct undoOp op = {kind, y, x, ey, ex, typed, now, n, text};
+    undoPush(&U.undo, &op);
+    U.sealed = 0;
+}
+
+// a replace is a single step however many rows it changed. Takes text over
+void undoRecordReplace(int y, int ey, char *text, size_t len) {
+    swapRecord(UNDO_REPLACE, 0, y, 0, ey, 0, text, len);
+    undoClear(&U.redo);
+    struct undoOp op = {UNDO_REPLACE, y, 0, ey, 0, 0, traceNow(), len, text};
+    undoPush(&U.undo, &op);
+    U.sealed = 1;
+}
+
+// replays op forwards, or backwards when undoing it, through the same
+// block operations a paste uses
+void undoApply(struct undoOp *op, int backwards) {
+    if (op->kind == UNDO_REPLACE) {
+        editorReplaceRows(op->text, op->len, backwards);
+        E.cy = op->y;
+        E.cx = 0;
+        return;
+    }
+    int insert = op->kind != UNDO_DELETE;
+    if (insert != backwards) {
+        E.cy = op->y;
+        E.cx = op->x;
+        editorInsertBlock(op->text, op->len, 0);
+    }
+    else {
+        editorDeleteRange(op->y, op->x, op->ey, op->ex);
+        if (op->kind == UNDO_APPEND) {
+            editorDelRow(op->y);
+        }
+        E.cy = op->y;
+        E.cx = op->x;
+    }
+}
+
+void editorUndo() {
+    struct undoOp op;
+    if (!undoPop(&U.undo, &op)) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    undoApply(&op, 1);
+    swapRecord(op.kind, 1, op.y, op.x, op.ey, op.ex, op.text, op.len);
+    undoPush(&U.redo, &op);
+    U.sealed = 1;
+}
+
+void editorRedo() {
+    struct undoOp op;
+    if (!undoPop(&U.redo, &op)) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    undoApply(&op, 0);
+    swapRecord(op.kind, 0, op.y, op.x, op.ey, op.ex, op.text, op.len);
+    undoPush(&U.undo, &op);
+    U.sealed = 1;
+}
+
+/*** ---------- swap journal ---------- ***/
+
+// every edit is appended to .<name>.crswp next to the file. The editor
+// only queues records; a writer thread lets them pile up for a moment, then
+// writes them in one go and syncs them, so one fdatasync covers a whole
+// burst of typing. Quitting removes the journal, anything else leaves it to be
+// replayed when the file is opened again
+
+unsigned int swapCrc32(unsigned int crc, const void *p, size_t len) {
+    static unsigned int table[256];
+    if (table[1] == 0) {
+        unsigned int j, k;
+        for (j = 0; j < 256; j++) {
+            unsigned int c = j;
+            for (k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[j] = c;
+        }
+    }
+    const unsigned char *s = p;
+    crc = ~crc;
+    while (len--) {
+        crc = table[(crc ^ *s++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// what the journal is written against: its records only apply to the file
+// as it was when it was opened or last saved
+void swapHeaderFor(char *filename, struct swapHeader *h) {
+    struct stat st;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, CRATE_SWAP_MAGIC, sizeof(h->magic));
+    if (stat(filename, &st) == 0) {
+        h->size = st.st_size;
+        h->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        h->ino = st.st_ino;
+    }
+}
+
+char *swapPathFor(char *filename) {
+    char *slash = strrchr(filename, '/');
+    char *path = malloc(strlen(filename) + 8);
+    if (path == NULL) {
+        die("malloc");
+    }
+    if (slash) {
+        sprintf(path, "%.*s/.%s.crswp", (int)(slash - filename), filename, slash + 1);
+    }
+    else {
+        sprintf(path, ".%s.crswp", filename);
+    }
+    return path;
+}
+
+int swapEnabled() {
+    char *env = getenv("CRATE_SWAP");
+    if (env) {
+        return atoi(env) != 0;
+    }
+    return !E.headless;
+}
+
+void *swapMain(void *arg) {
+    (void)arg;
+    struct abuf batch = {NULL, 0, 0};
+    pthread_mutex_lock(&S.lock);
+    while (1) {
+        while (S.queue.len == 0 && !S.restart && !S.stop) {
+            S.idle = 1;
+            pthread_cond_wait(&S.wake, &S.lock);
+            S.idle = 0;
+        }
+        if (S.queue.len == 0 && !S.restart) {
+            break;  // stopping and caught up
+        }
+        if (!S.stop) {
+            pthread_mutex_unlock(&S.lock);
+            struct timespec delay = {0, CRATE_SWAP_DELAY * 1000000L};
+            nanosleep(&delay, NULL);
+            pthread_mutex_lock(&S.lock);
+        }
+        struct abuf t = batch;
+        batch = S.queue;
+        S.queue = t;
+        abReset(&S.queue);
+        int restart = S.restart;
+        struct swapHeader header = S.header;
+        S.restart = 0;
+        pthread_mutex_unlock(&S.lock);
+
+        // a save made everything before it moot: start over against the
+        // file as it is now. The journal itself is only created once there
+        // is something to put in it
+        if ((restart && !S.fresh) || (S.fresh && batch.len > 0)) {
+            S.fresh = 0;
+            if (ftruncate(S.fd, 0) == -1 ||
+                pwrite(S.fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+                lseek(S.fd, sizeof(header), SEEK_SET) == -1) {
+                S.fresh = 1;
+                abReset(&batch);
+            }
+        }
+        struct iovec iov = {batch.b, batch.len};
+        if (batch.len > 0 && editorWritev(S.fd, &iov, 1) == 0) {
+            fdatasync(S.fd);
+        }
+        abReset(&batch);
+
+        pthread_mutex_lock(&S.lock);
+    }
+    pthread_mutex_unlock(&S.lock);
+    abFree(&batch);
+    return NULL;
+}
+
+// queues one edit for the writer; never waits on the disk
+void swapRecord(int kind, int backwards, int y, int x, int ey, int ex,
+                const char *text, size_t len) {
+    if (!S.running) {
+        return;
+    }
+    struct swapEntry r = {0, len, kind, backwards, y, x, ey, ex};
+    r.crc = swapCrc32(0, &r.len, sizeof(r) - sizeof(r.crc));
+    r.crc = swapCrc32(r.crc, text, len);
+    pthread_mutex_lock(&S.lock);
+    abAppend(&S.queue, (char *)&r, sizeof(r));
+    abAppend(&S.queue, text, len);
+    if (S.idle) {
+        pthread_cond_signal(&S.wake);  // busy writers come back for it anyway
+    }
+    pthread_mutex_unlock(&S.lock);
+}
+
+// an edit from the journal is only replayed if it fits the rows as they are
+int swapFits(struct swapEntry *r, const char *text) {
+    if (r->kind == UNDO_REPLACE) {
+        // every row it names must have the length it is to be replaced from
+        int h[3];
+        size_t at;
+        for (at = 0; at + sizeof(h) <= r->len; at += sizeof(h) + h[1] + h[2]) {
+            memcpy(h, text + at, sizeof(h));
+            erow *row = editorRowAt(h[0]);
+            if (h[1] < 0 || h[2] < 0 || at + sizeof(h) + (size_t)h[1] + h[2] > r->len ||
+                row == NULL || row->size != (r->backwards ? h[2] : h[1])) {
+                return 0;
+            }
+        }
+        return at == r->len;
+    }
+    erow *row = editorRowAt(r->y);
+    if (r->y < 0 || r->y > E.numrows || r->x < 0 || r->x > (row ? row->size : 0)) {
+        return 0;
+    }
+    int insert = r->kind != UNDO_DELETE;
+    if (insert != r->backwards) {
+        return 1;
+    }
+    erow *last = editorRowAt(r->ey);
+    if (row == NULL || r->ey < r->y || r->ey > E.numrows ||
+        r->ex < 0 || r->ex > (last ? last->size : 0) ||
+        (r->ey == r->y && r->ex < r->x)) {
+        return 0;
+    }
+    return r->kind != UNDO_APPEND || r->x == 0;
+}
+
+// replays the journal in fd, left behind for the file just opened, if it
+// was written against the file as it is now. Returns 1 if fd is left ready
+// for appending after the last intact record, 0 if it has to start over
+int swapRecover(int fd, struct swapHeader *header) {
+    struct stat st;
+    struct swapHeader h;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        return 0;
+    }
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || memcmp(&h, header, sizeof(h)) != 0) {
+        editorSetStatusMessage("%s was written against another version of the file, ignored",
+                               S.path);
+        return 0;
+    }
+
+    char *buf = malloc(st.st_size);
+    if (buf == NULL) {
+        die("malloc");
+    }
+    off_t len = 0;
+    ssize_t n;
+    while (len < st.st_size && (n = pread(fd, buf + len, st.st_size - len, len)) > 0) {
+        len += n;
+    }
+
+    // a torn record at the end is where the editor stopped; it and anything
+    // after it are dropped
+    off_t at = sizeof(h);
+    int replayed = 0;
+    while (at + (off_t)sizeof(struct swapEntry) <= len) {
+        struct swapEntry r;
+        memcpy(&r, buf + at, sizeof(r));
+        char *text = buf + at + sizeof(r);
+        if (r.len > len - at - sizeof(r) ||
+            swapCrc32(swapCrc32(0, &r.len, sizeof(r) - sizeof(r.crc)), text, r.len) != r.crc ||
+            !swapFits(&r, text)) {
+            break;
+        }
+        struct undoOp op = {r.kind, r.y, r.x, r.ey, r.ex, 0, 0, r.len, text};
+        undoApply(&op, r.backwards);
+        at += sizeof(r) + r.len;
+        replayed++;
+    }
+    free(buf);
+
+    if (ftruncate(fd, at) == -1 || lseek(fd, at, SEEK_SET) == -1) {
+        return 0;
+    }
+    if (replayed > 0) {
+        E.cx = 0;
+        E.cy = 0;
+        E.dirty = replayed;
+        editorSetStatusMessage("Recovered %d unsaved edits from %s", replayed, S.path);
+    }
+    return 1;
+}
+
+// opens the journal and takes a lock on it, so a second editor on the same
+// file neither replays nor appends to it. It sits next to the user's file,
+// where anyone who can write the directory could have planted a symlink or
+// a fifo, so it has to be a regular file reached without following links.
+// The lock only counts if the path still names the file that was locked:
+// a journal discarded in between is unlinked and tried again
+int swapOpen() {
+    while (1) {
+        int fd = open(S.path, O_RDWR | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            return -1;
+        }
+        struct stat st, cur;
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || flock(fd, LOCK_EX | LOCK_NB) == -1) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        if (lstat(S.path, &cur) == 0 && cur.st_dev == st.st_dev && cur.st_ino == st.st_ino) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+// lets the writer finish what is queued and stops it, leaving the journal
+// behind. Runs at exit, so a hangup or a crash still gets the last edits out
+void swapFlush() {
+    if (!S.running) {
+        return;
+    }
+    pthread_mutex_lock(&S.lock);
+    S.stop = 1;
+    pthread_cond_signal(&S.wake);
+    pthread_mutex_unlock(&S.lock);
+    pthread_join(S.thread, NULL);
+    // a journal nothing was ever written to is not worth leaving behind
+    struct stat st;
+    if (S.fresh && fstat(S.fd, &st) == 0 && st.st_size == 0) {
+        unlink(S.path);
+    }
+    close(S.fd);
+    S.running = 0;
+}
+
+// starts journaling edits to the file being edited, after replaying what a
+// previous session left unsaved when recovering
+void swapStart(int recover) {
+    if (S.running || E.filename == NULL || !swapEnabled()) {
+        return;
+    }
+    S.path = swapPathFor(E.filename);
+    S.fd = swapOpen();
+    if (S.fd == -1) {
+        if (recover && errno == EWOULDBLOCK) {
+            editorSetStatusMessage("%s is in use by another editor, edits are not journaled", S.path);
+        }
+        else if (recover) {
+            editorSetStatusMessage("Cannot journal edits to %s: %s", S.path, strerror(errno));
+        }
+        free(S.path);
+        S.path = NULL;
+        return;
+    }
+    swapHeaderFor(E.filename, &S.header);
+    S.fresh = !(recover && swapRecover(S.fd, &S.header));
+    S.restart = 0;
+    S.stop = 0;
+    S.idle = 0;
+    S.queue = (struct abuf){NULL, 0, 0};
+    pthread_mutex_init(&S.lock, NULL);
+    pthread_cond_init(&S.wake, NULL);
+    if (pthread_create(&S.thread, NULL, swapMain, NULL) != 0) {
+        close(S.fd);
+        return;
+    }
+    S.running = 1;
+    atexit(swapFlush);
+}
+
+// the file on disk now holds every edit: later records go against it
+void swapRestart() {
+    if (!S.running) {
+        swapStart(0);
+        return;
+    }
+    pthread_mutex_lock(&S.lock);
+    swapHeaderFor(E.filename, &S.header);
+    S.restart = 1;
+    abReset(&S.queue);
+    pthread_cond_signal(&S.wake);
+    pthread_mutex_unlock(&S.lock);
+}
+
+// quitting on purpose: nothing is left to recover. The journal goes while
+// it is still locked, so no other editor can have taken it over
+void swapDiscard() {
+    if (!S.running) {
+        return;
+    }
+    pthread_mutex_lock(&S.lock);
+    abReset(&S.queue);
+    S.restart = 0;
+    pthread_mutex_unlock(&S.lock);
+    unlink(S.path);
+    swapFlush();
+}
+
+/*** ---------- workers ---------- ***/
+
+struct workerPool {
+    void (*fn)(int task, void *arg);
+    void *arg;
+    int ntasks;
+    int next;
+};
+
+void *workerMain(void *p) {
+    struct workerPool *pool = p;
+    int task;
+    while ((task = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->ntasks) {
+        pool->fn(task, pool->arg);
+    }
+    return NULL;
+}
+
+int editorWorkerCount() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > CRATE_MAX_WORKERS) {
+        n = CRATE_MAX_WORKERS;
+    }
+    return n;
+}
+
+// runs fn for every task in [0, ntasks) spread over one thread per core. The
+// calling thread pulls tasks too and the call returns when all are done
+void editorParallelFor(int ntasks, void (*fn)(int task, void *arg), void *arg) {
+    struct workerPool pool = {fn, arg, ntasks, 0};
+    pthread_t threads[CRATE_MAX_WORKERS];
+    int nthreads = editorWorkerCount() - 1;
+    if (nthreads > ntasks - 1) {
+        nthreads = ntasks - 1;
+    }
+
+    int started = 0;
+    int j;
+    for (j = 0; j < nthreads; j++) {
+        if (pthread_create(&threads[started], NULL, workerMain, &pool) == 0) {
+            started++;
+        }
+    }
+    workerMain(&pool);
+    for (j = 0; j < started; j++) {
+        pthread_join(threads[j], NULL);
+    }
+}
+
+/*** ---------- line indexing ---------- ***/
+
+struct lineChunk {
+    unsigned int *offs;  // '\n' positions relative to the start of the chunk
+    size_t len;
+    size_t cap;
+    size_t linestart;  // file offset of the first line ending in this chunk
+    int firstrow;
+};
+
+struct lineIndex {
+    char *map;
+    size_t len;
+    int nchunks;
+    struct lineChunk *chunks;
+    rowNode *nodes;
+};
+
+void lineChunkPush(struct lineChunk *c, size_t off) {
+    if (c->len == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 1024;
+        c->offs = realloc(c->offs, sizeof(unsigned int) * c->cap);
+        if (c->offs == NULL) {
+            die("realloc");
+        }
+    }
+    c->offs[c->len++] = off;
+}
+
+void scanNewlinesScalar(const char *p, size_t len, struct lineChunk *c) {
+    const char *q = p;
+    const char *end = p + len;
+    while ((q = memchr(q, '\n', end - q)) != NULL) {
+        lineChunkPush(c, q - p);
+        q++;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// compare 16 bytes at a time against '\n' and walk the set bits of the mask
+__attribute__((target("sse2")))
+void scanNewlinesSSE2(const char *p, size_t len, struct lineChunk *c) {
+    __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+            lineChunkPush(c, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; i++) {
+        if (p[i] == '\n') {
+            lineChunkPush(c, i);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void scanNewlinesAVX2(const char *p, size_t len, struct lineChunk *c) {
+    __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        while (mask) {
+            lineChunkPush(c, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; i++) {
+        if (p[i] == '\n') {
+            lineChunkPush(c, i);
+        }
+    }
+}
+#endif
+
+void scanNewlines(const char *p, size_t len, struct lineChunk *c) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        scanNewlinesAVX2(p, len, c);
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        scanNewlinesSSE2(p, len, c);
+        return;
+    }
+#endif
+    scanNewlinesScalar(p, len, c);
+}
+
+void lineIndexScanTask(int task, void *arg) {
+    struct lineIndex *li = arg;
+    size_t start = (size_t)task * CRATE_SCAN_CHUNK;
+    size_t len = li->len - start < CRATE_SCAN_CHUNK ? li->len - start : CRATE_SCAN_CHUNK;
+    scanNewlines(li->map + start, len, &li->chunks[task]);
+}
+
+void lineIndexSetRow(struct lineIndex *li, int at, size_t start, size_t end) {
+    while (end > start && li->map[end - 1] == '\r') {
+        end--;
+    }
+    erow *row = &li->nodes[at].row;
+    row->size = end - start;
+    row->chars = li->map + start;
+    row->flags = ROW_MAPPED;
+    row->cols = -1;
+    row->lines = 1;
+    row->rsize = 0;
+    row->render = NULL;
+    row->rcap = 0;
+    row->rslot = -1;
+}
+
+void lineIndexFillTask(int task, void *arg) {
+    struct lineIndex *li = arg;
+    struct lineChunk *c = &li->chunks[task];
+    size_t base = (size_t)task * CRATE_SCAN_CHUNK;
+    size_t start = c->linestart;
+    size_t j;
+    for (j = 0; j < c->len; j++) {
+        size_t nl = base + c->offs[j];
+        lineIndexSetRow(li, c->firstrow + j, start, nl);
+        start = nl + 1;
+    }
+    free(c->offs);
+}
+
+// splits the mapping into chunks, finds the newlines of every chunk on its
+// own core, then stitches the per-chunk offsets into one block of row nodes
+rowNode *editorIndexLines(char *map, size_t len, int *nlines) {
+    struct lineIndex li;
+    li.map = map;
+    li.len = len;
+    li.nchunks = (len + CRATE_SCAN_CHUNK - 1) / CRATE_SCAN_CHUNK;
+    li.chunks = calloc(li.nchunks, sizeof(struct lineChunk));
+    if (li.chunks == NULL) {
+        die("calloc");
+    }
+    editorParallelFor(li.nchunks, lineIndexScanTask, &li);
+
+    int rows = 0;
+    size_t linestart = 0;
+    int j;
+    for (j = 0; j < li.nchunks; j++) {
+        struct lineChunk *c = &li.chunks[j];
+        c->firstrow = rows;
+        c->linestart = linestart;
+        rows += c->len;
+        if (c->len > 0) {
+            linestart = (size_t)j * CRATE_SCAN_CHUNK + c->offs[c->len - 1] + 1;
+        }
+    }
+    int tail = linestart < len;  // last line has no newline
+
+    li.nodes = malloc(sizeof(rowNode) * (rows + tail));
+    if (li.nodes == NULL) {
+        die("malloc");
+    }
+    editorParallelFor(li.nchunks, lineIndexFillTask, &li);
+    if (tail) {
+        lineIndexSetRow(&li, rows, linestart, len);
+    }
+
+    free(li.chunks);
+    *nlines = rows + tail;
+    return li.nodes;
+}
+
+/*** ---------- search index ---------- ***/
+
+// opt in with CRATE_INDEX=1. The mapping never changes under the index:
+// edited rows move to the heap and are always scanned in full, and a save
+// that maps the new file starts the index over
+
+unsigned int indexHash(const unsigned char *p) {
+    unsigned int t = p[0] << 16 | p[1] << 8 | p[2];
+    return (t * 2654435761u) >> (32 - CRATE_INDEX_BITS);
+}
+
+int indexEnabled() {
+    char *env = getenv("CRATE_INDEX");
+    return env && atoi(env) != 0;
+}
+
+size_t indexWords() {
+    return (1 << CRATE_INDEX_BITS) / 64;
+}
+
+void *indexMain(void *arg) {
+    (void)arg;
+    const unsigned char *p = (const unsigned char *)I.map;
+    int b;
+    for (b = 0; b < I.nblocks && !__atomic_load_n(&I.stop, __ATOMIC_RELAXED); b++) {
+        size_t start = (size_t)b * CRATE_INDEX_BLOCK;
+        size_t end = start + CRATE_INDEX_BLOCK < I.maplen ? start + CRATE_INDEX_BLOCK : I.maplen;
+        // the row indexing left the mapping on MADV_RANDOM: ask for the
+        // block up front instead of faulting it in page by page
+        madvise(I.map + start, end - start, MADV_WILLNEED);
+
+        // every trigram starting in the block, the last two running on into
+        // the next one
+        size_t last = end < I.maplen - 2 ? end : I.maplen - 2;
+        unsigned long long *bits = I.bits + b * indexWords();
+        size_t i;
+        for (i = start; i < last; i++) {
+            unsigned int h = indexHash(p + i);
+            bits[h / 64] |= 1ULL << (h % 64);
+        }
+        madvise(I.map + start, end - start, MADV_DONTNEED);
+        __atomic_store_n(&I.built, b + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// keeps the progress in the status bar moving while the index builds
+void indexTick(void *arg) {
+    (void)arg;
+    if (I.running && __atomic_load_n(&I.built, __ATOMIC_ACQUIRE) < I.nblocks) {
+        editorAddTimer(CRATE_INDEX_TICK, indexTick, NULL);
+    }
+}
+
+void indexStart() {
+    if (I.running || E.map == NULL || E.maplen < 3 || !indexEnabled()) {
+        return;
+    }
+    I.map = E.map;
+    I.maplen = E.maplen;
+    I.nblocks = (E.maplen + CRATE_INDEX_BLOCK - 1) / CRATE_INDEX_BLOCK;
+    I.bits = calloc(I.nblocks * indexWords(), sizeof(unsigned long long));
+    if (I.bits == NULL) {
+        editorSetStatusMessage("No memory for a search index");
+        return;
+    }
+    I.built = 0;
+    I.stop = 0;
+    if (pthread_create(&I.thread, NULL, indexMain, NULL) != 0) {
+        free(I.bits);
+        I.bits = NULL;
+        return;
+    }
+    I.running = 1;
+    editorAddTimer(CRATE_INDEX_TICK, indexTick, NULL);
+}
+
+// must run before the mapping goes away
+void indexStop() {
+    if (!I.running) {
+        return;
+    }
+    __atomic_store_n(&I.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(I.thread, NULL);
+    free(I.bits);
+    I.bits = NULL;
+    I.running = 0;
+}
+
+// whether a match of q could start in block b: each of its trigrams starts
+// either in b or, when the match runs over the end of b, in the block after.
+// Blocks not indexed yet may hold anything
+int indexMaybe(long b, const char *q, int qlen) {
+    int built = __atomic_load_n(&I.built, __ATOMIC_ACQUIRE);
+    int hasnext = b + 1 < I.nblocks;
+    if (b >= built || (hasnext && b + 1 >= built)) {
+        return 1;
+    }
+    unsigned long long *cur = I.bits + b * indexWords();
+    unsigned long long *next = hasnext ? cur + indexWords() : NULL;
+    int i;
+    for (i = 0; i + 3 <= qlen; i++) {
+        unsigned int h = indexHash((const unsigned char *)q + i);
+        unsigned long long bit = 1ULL << (h % 64);
+        if (!(cur[h / 64] & bit) && !(next && (next[h / 64] & bit))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// narrows [*lo, *hi), a stretch of the mapping being searched for q, by the
+// blocks at its low end (dir > 0) or its high end that cannot hold a match
+void indexNarrow(const char **lo, const char **hi, const char *q, int qlen, int dir) {
+    if (!I.running || qlen < 3 || qlen > CRATE_INDEX_BLOCK ||
+        *lo < I.map || *hi > I.map + I.maplen || *hi - *lo < qlen) {
+        return;
+    }
+    long first = (*lo - I.map) / CRATE_INDEX_BLOCK;
+    long last = (*hi - qlen - I.map) / CRATE_INDEX_BLOCK;  // holds the last start
+    if (dir > 0) {
+        while (first <= last && !indexMaybe(first, q, qlen)) {
+            first++;
+        }
+        if (first > last) {
+            *lo = *hi;
+        }
+        else if (I.map + first * CRATE_INDEX_BLOCK > *lo) {
+            *lo = I.map + first * CRATE_INDEX_BLOCK;
+        }
+    }
+    else {
+        while (last >= first && !indexMaybe(last, q, qlen)) {
+            last--;
+        }
+        if (last < first) {
+            *hi = *lo;
+        }
+        else if (I.map + (last + 1) * CRATE_INDEX_BLOCK + qlen - 1 < *hi) {
+            *hi = I.map + (last + 1) * CRATE_INDEX_BLOCK + qlen - 1;
+        }
+    }
+}
+
+/*** ---------- file i/o ---------- ***/
+
+// something else truncated the mapped file (logrotate's copytruncate, say)
+// and a page of the map past its new end was read, which raises SIGBUS.
+// The page is swapped for one of zeros and the read goes ahead, so unsaved
+// edits and the journal live on; the next frame reports it. Any other SIGBUS
+// is a real fault and is raised again with the default action
+void editorMapFault(int sig, siginfo_t *si, void *ctx) {
+    (void)ctx;
+    char *map = E.map;
+    char *addr = si->si_addr;
+    if (map != NULL && addr >= map && addr < map + E.maplen) {
+        char *page = map + ((addr - map) & ~(E.pagesize - 1));
+        if (mmap(page, E.pagesize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                 -1, 0) != MAP_FAILED) {
+            E.mapcut = 1;
+            return;
+        }
+    }
+    signal(sig, SIG_DFL);
+}
+
+void editorMapRelease() {
+    if (E.map == NULL) {
+        return;
+    }
+    indexStop();
+    munmap(E.map, E.maplen);
+    close(E.mapfd);
+    E.map = NULL;
+    E.maplen = 0;
+    E.mapfd = -1;
+}
+
+// remembers what the mapped file looked like, so a save can tell whether
+// something else has written to it since
+void editorMapStat() {
+    if (E.mapfd == -1 || fstat(E.mapfd, &E.mapst) == -1) {
+        memset(&E.mapst, 0, sizeof(E.mapst));
+    }
+}
+
+// points every row at its line inside base, a mapping of the file fd was
+// just saved to. Heap copies are dropped, so after a save only rows edited
+// from then on cost memory again
+void editorRebaseRows(char *base, size_t len, int fd) {
+    editorMapRelease();
+
+    size_t off = 0;
+    erow *row;
+    editorGapClose();
+    for (row = editorRowAt(0); row; row = editorRowNext(row)) {
+        if (!(row->flags & ROW_MAPPED)) {
+            free(row->chars);
+        }
+        row->chars = base + off;
+        row->flags |= ROW_MAPPED;
+        if (row->flags & ROW_RAW) {
+            row->render = row->chars;
+        }
+        off += row->size + 1;
+    }
+
+    E.map = base;
+    E.maplen = len;
+    E.mapfd = fd;
+    editorMapStat();
+    ropeFixCounts(E.rows);
+    indexStart();
+}
+
+// rows of a mapped file are just (pointer, length) pairs into the mapping;
+// nothing is copied and render is only built once a row is drawn
+int editorOpenMapped(int fd, size_t len) {
+    char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    int nlines;
+    rowNode *nodes = editorIndexLines(map, len, &nlines);
+
+    // indexing touched every page; let them go again so the resident set
+    // only grows with what is actually looked at
+    madvise(map, len, MADV_DONTNEED);
+    madvise(map, len, MADV_RANDOM);
+
+    editorMapRelease();
+    E.map = map;
+    E.maplen = len;
+    E.mapfd = fd;
+    editorMapStat();
+
+    if (nlines > 0) {
+        ropeInsertSpan(E.numrows, ropeBuild(nodes, nlines));
+    }
+    else {
+        free(nodes);
+    }
+    indexStart();
+    return 0;
+}
+
+void editorOpen(char *filename) {
+    long long t = traceNow();
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        die("open");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        editorOpenMapped(fd, st.st_size) == 0) {
+        E.dirty = 0;
+        swapStart(1);
+        traceSpan(TRACE_OPEN, 0, t);
+        return;
+    }
+
+    // pipes, devices and anything mmap refuses are read line by line
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) {
+        die("fdopen");
+    }
+
+    // collect every line into one node block and build the tree in a single
+    // pass instead of inserting (and rebalancing) one row at a time
+    int nodecap = 1024;
+    int nlines = 0;
+    rowNode *nodes = malloc(sizeof(rowNode) * nodecap);
+    if (nodes == NULL) {
+        die("malloc");
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        if (linelen != -1) {
+            while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                                line[linelen - 1] == '\r')) {
+                linelen--;
+            }
+
+            nodes = editorGrowNodes(nodes, &nodecap, nlines);
+            editorInitRow(&nodes[nlines++].row, line, linelen);
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if (nlines > 0) {
+        nodes = realloc(nodes, sizeof(rowNode) * nlines);
+        ropeInsertSpan(E.numrows, ropeBuild(nodes, nlines));
+    }
+    else {
+        free(nodes);
+    }
+    E.dirty = 0;
+    swapStart(1);
+    traceSpan(TRACE_OPEN, 0, t);
+}
+
+// writes all of iov, picking up after short writes and interrupts. iov is
+// used up in the process
+int editorWritev(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// what a save has to produce, in order: stretches of the file on disk that
+// are still valid (row NULL) and rows that have to be written out
+struct saveSeg {
+    long long off;
+    long long len;
+    erow *row;
+};
+
+struct savePlan {
+    struct saveSeg *segs;
+    int n;
+    int cap;
+    long long total;
+};
+
+void savePlanPush(struct savePlan *plan, long long off, long long len, erow *row) {
+    plan->total += len;
+    if (row == NULL && plan->n > 0) {
+        struct saveSeg *last = &plan->segs[plan->n - 1];
+        if (last->row == NULL && last->off + last->len == off) {
+            last->len += len;
+            return;
+        }
+    }
+    if (plan->n == plan->cap) {
+        plan->cap = plan->cap ? plan->cap * 2 : 64;
+        plan->segs = realloc(plan->segs, sizeof(struct saveSeg) * plan->cap);
+        if (plan->segs == NULL) {
+            die("realloc");
+        }
+    }
+    plan->segs[plan->n++] = (struct saveSeg){off, len, row};
+}
+
+// walks the tree but skips every subtree that is one unbroken stretch of the
+// file, so the plan costs time in proportion to what was edited
+void savePlanCollect(struct savePlan *plan, rowNode *n) {
+    if (n == NULL) {
+        return;
+    }
+    if (n->span) {
+        savePlanPush(plan, n->span - E.map, n->bytes, NULL);
+        return;
+    }
+    savePlanCollect(plan, n->left);
+    char *line = editorRowFileLine(&n->row);
+    if (line) {
+        savePlanPush(plan, line - E.map, n->row.size + 1, NULL);
+    }
+    else {
+        savePlanPush(plan, -1, n->row.size + 1, &n->row);
+    }
+    savePlanCollect(plan, n->right);
+}
+
+// copies len bytes at off of the mapped file to fd, in the kernel where it
+// can (reflinking on filesystems that share extents), else from the mapping
+int saveCopyExtent(int fd, long long off, long long len) {
+    loff_t in = off;
+    while (len > 0) {
+        ssize_t n = copy_file_range(E.mapfd, &in, fd, NULL, len, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len -= n;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    struct iovec iov = {E.map + in, len};
+    return editorWritev(fd, &iov, 1);
+}
+
+// writes out the plan, each run of rows with batched writevs and each valid
+// stretch of the old file copied over
+int saveWritePlan(int fd, struct savePlan *plan) {
+    struct iovec iov[CRATE_SAVE_IOV];
+    int cnt = 0;
+    int j;
+    for (j = 0; j < plan->n; j++) {
+        struct saveSeg *seg = &plan->segs[j];
+        if (seg->row) {
+            iov[cnt].iov_base = seg->row->chars;
+            iov[cnt].iov_len = seg->row->size;
+            iov[cnt + 1].iov_base = "\n";
+            iov[cnt + 1].iov_len = 1;
+            cnt += 2;
+        }
+        if (cnt == CRATE_SAVE_IOV || (seg->row == NULL && cnt > 0)) {
+            if (editorWritev(fd, iov, cnt) == -1) {
+                return -1;
+            }
+            cnt = 0;
+        }
+        if (seg->row == NULL && saveCopyExtent(fd, seg->off, seg->len) == -1) {
+            return -1;
+        }
+    }
+    return editorWritev(fd, iov, cnt);
+}
+
+// in-place saves are opt-in: they write far less for small edits to huge
+// files, but a crash part way leaves a file that is half old and half new
+int savePatchEnabled() {
+    char *env = getenv("CRATE_SAVE_INPLACE");
+    return env && atoi(env) != 0;
+}
+
+// when only the content of rows changed and never a length, every valid
+// stretch is still where it was and only the edited bytes need writing, into
+// the file itself. Returns 1 if the layout moved, the file was changed by
+// something else, or in-place saves are off, and a full save is needed
+int savePatchInPlace(char *path, struct savePlan *plan) {
+    if (!savePatchEnabled() || E.map == NULL || plan->total != (long long)E.maplen) {
+        return 1;
+    }
+    // rows still mapped (cut short by a newline) must sit where they were,
+    // or writing another row could change bytes they point at
+    long long pos = 0;
+    int j;
+    for (j = 0; j < plan->n; j++) {
+        struct saveSeg *seg = &plan->segs[j];
+        if (seg->row == NULL && seg->off != pos) {
+            return 1;
+        }
+        if (seg->row && (seg->row->flags & ROW_MAPPED) && seg->row->chars != E.map + pos) {
+            return 1;
+        }
+        pos += seg->len;
+    }
+
+    // path must still be the file the rows are mapped from, untouched since:
+    // appended bytes would survive the patch and a truncated file would be
+    // patched at offsets that no longer mean anything
+    struct stat target;
+    int fd = open(path, O_WRONLY);
+    if (fd == -1 || fstat(fd, &target) == -1 ||
+        target.st_dev != E.mapst.st_dev || target.st_ino != E.mapst.st_ino ||
+        target.st_size != (off_t)E.maplen || target.st_size != E.mapst.st_size ||
+        target.st_mtim.tv_sec != E.mapst.st_mtim.tv_sec ||
+        target.st_mtim.tv_nsec != E.mapst.st_mtim.tv_nsec) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return 1;
+    }
+
+    pos = 0;
+    for (j = 0; j < plan->n; j++) {
+        struct saveSeg *seg = &plan->segs[j];
+        if (seg->row) {
+            struct iovec iov[2] = {{seg->row->chars, seg->row->size}, {"\n", 1}};
+            if (lseek(fd, pos, SEEK_SET) == -1 || editorWritev(fd, iov, 2) == -1) {
+                close(fd);
+                return -1;
+            }
+        }
+        pos += seg->len;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    // the next patch has to recognise our own write
+    editorMapStat();
+    return ret;
+}
+
+// moves the rows onto a mapping of fd, the file the plan was just written to
+// (len bytes), and marks the buffer clean. Takes fd over
+void editorSaveDone(int fd, long long len) {
+    char *map = len > 0 ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED) {
+        editorRebaseRows(map, len, fd);
+    }
+    else {
+        close(fd);
+    }
+    E.dirty = 0;
+    editorSetStatusMessage("%lld bytes written to disk", len);
+}
+
+// rewrites path itself, for when its directory will not take a temp file
+// (a file edited through its group permissions, say). The rows may point
+// into the file being overwritten, so the whole plan is first gathered into
+// an anonymous mapping; if the write fails part way the rows move onto that
+// and nothing in the buffer is lost, though the file may be a mix of both
+int editorSaveOver(char *path, struct savePlan *plan) {
+    size_t cap = plan->total > 0 ? plan->total : 1;
+    char *buf = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        return -1;
+    }
+    long long at = 0;
+    int j;
+    for (j = 0; j < plan->n; j++) {
+        struct saveSeg *seg = &plan->segs[j];
+        if (seg->row) {
+            memcpy(buf + at, seg->row->chars, seg->row->size);
+            buf[at + seg->row->size] = '\n';
+        }
+        else {
+            memcpy(buf + at, E.map + seg->off, seg->len);
+        }
+        at += seg->len;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        munmap(buf, cap);
+        return -1;
+    }
+    // the index thread reads the old mapping, which is about to change
+    indexStop();
+    if (plan->total == 0) {
+        editorMapRelease();
+    }
+    struct iovec iov = {buf, plan->total};
+    if (editorWritev(fd, &iov, 1) == -1 || ftruncate(fd, plan->total) == -1 ||
+        fsync(fd) == -1) {
+        int err = errno;
+        close(fd);
+        if (plan->total > 0) {
+            editorRebaseRows(buf, plan->total, -1);
+        }
+        else {
+            munmap(buf, cap);
+        }
+        errno = err;
+        return -1;
+    }
+    munmap(buf, cap);
+    editorSaveDone(fd, plan->total);
+    return 0;
+}
+
+// writes the plan to a temp file next to the target, syncs it and renames
+// it over the target, so a crash or full disk leaves either the old file or
+// the new one and never half of either. Rows keep pointing into the old
+// mapping until the new file is complete, then move to a mapping of it.
+// Only the mode carries over: the new file has our owner and group, its
+// own xattrs and ACLs, and other hard links keep the old contents
+int editorSaveReplace(char *path, struct savePlan *plan) {
+    char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    char *tmp = malloc(strlen(path) + 16);
+    if (dir == NULL || tmp == NULL) {
+        die("malloc");
+    }
+    if (slash) {
+        sprintf(tmp, "%.*s/.%s.XXXXXX", (int)(slash - path), path, slash + 1);
+    }
+    else {
+        sprintf(tmp, ".%s.XXXXXX", path);
+    }
+
+    int ret = -1;
+    int fd = mkstemp(tmp);
+    if (fd == -1 && (errno == EACCES || errno == EPERM) && access(path, W_OK) == 0) {
+        ret = editorSaveOver(path, plan);
+    }
+    else if (fd != -1) {
+        // keep the mode of the file being replaced; new files get 0644
+        struct stat st;
+        mode_t mode;
+        if (stat(path, &st) == 0) {
+            mode = st.st_mode & 07777;
+        }
+        else {
+            mode_t mask = umask(0);
+            umask(mask);
+            mode = 0644 & ~mask;
+        }
+
+        if (fchmod(fd, mode) == 0 && saveWritePlan(fd, plan) == 0 &&
+            fsync(fd) == 0 && rename(tmp, path) == 0) {
+            // make the rename itself durable
+            int dfd = open(dir, O_RDONLY);
+            if (dfd != -1) {
+                fsync(dfd);
+                close(dfd);
+            }
+            editorSaveDone(fd, plan->total);
+            ret = 0;
+        }
+        else {
+            int err = errno;
+            close(fd);
+            unlink(tmp);
+            errno = err;
+        }
+    }
+
+    free(dir);
+    free(tmp);
+    return ret;
+}
+
+// a save plan comes from the tree first: whatever is unchanged since the
+// file was mapped gets copied rather than written, and with CRATE_SAVE_INPLACE
+// set and no line changed in length the edited lines are patched straight
+// into the file
+void editorSave() {
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    long long t = traceNow();
+
+    // save through symlinks rather than replacing them
+    char *path = realpath(E.filename, NULL);
+    if (path == NULL && (path = strdup(E.filename)) == NULL) {
+        die("strdup");
+    }
+
+    struct savePlan plan = {NULL, 0, 0, 0};
+    editorGapClose();
+    savePlanCollect(&plan, E.rows);
+
+    int ret = savePatchInPlace(path, &plan);
+    if (ret == 0) {
+        E.dirty = 0;
+        editorSetStatusMessage("%lld bytes written to disk", plan.total);
+    }
+    else if (ret == 1) {
+        ret = editorSaveReplace(path, &plan);
+    }
+    if (ret == -1) {
+        editorSetStatusMessage("Cannot save! I/O error: %s", strerror(errno));
+    }
+    else {
+        swapRestart();
+    }
+    free(plan.segs);
+    free(path);
+    traceSpan(TRACE_SAVE, 0, t);
+}
+
+/*** ---------- find ---------- ***/
+
+// where q first (or, with last set, last) occurs in p[0..len), -1 if it does
+// not. Blocks of start positions are tested at once for a matching first
+// and last byte, and only those candidates are compared in full
+long searchScalar(const char *p, long len, const char *q, int qlen, int last) {
+    long i;
+    if (!last) {
+        char *hit = memmem(p, len, q, qlen);
+        return hit ? hit - p : -1;
+    }
+    for (i = len - qlen; i >= 0; i--) {
+        if (p[i] == q[0] && memcmp(p + i, q, qlen) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+long searchSSE2(const char *p, long len, const char *q, int qlen, int last) {
+    __m128i f = _mm_set1_epi8(q[0]);
+    __m128i l = _mm_set1_epi8(q[qlen - 1]);
+    long n = len - qlen + 1;  // start positions
+    if (n < 16) {
+        return searchScalar(p, len, q, qlen, last);
+    }
+    long i = last ? n - 16 : 0;
+    while (last ? i >= 0 : i + 16 <= n) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + qlen - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, f),
+                                                            _mm_cmpeq_epi8(b, l)));
+        while (mask) {
+            int bit = last ? 31 - __builtin_clz(mask) : __builtin_ctz(mask);
+            if (qlen <= 2 || memcmp(p + i + bit + 1, q + 1, qlen - 2) == 0) {
+                return i + bit;
+            }
+            mask &= ~(1u << bit);
+        }
+        i += last ? -16 : 16;
+    }
+    // the starts left over at the far end
+    long rest = last ? i + 16 : i;
+    long h = last ? searchScalar(p, rest + qlen - 1, q, qlen, 1)
+                  : searchScalar(p + rest, len - rest, q, qlen, 0);
+    return h < 0 ? -1 : (last ? h : rest + h);
+}
+
+__attribute__((target("avx2")))
+long searchAVX2(const char *p, long len, const char *q, int qlen, int last) {
+    __m256i f = _mm256_set1_epi8(q[0]);
+    __m256i l = _mm256_set1_epi8(q[qlen - 1]);
+    long n = len - qlen + 1;
+    if (n < 32) {
+        return searchScalar(p, len, q, qlen, last);
+    }
+    long i = last ? n - 32 : 0;
+    while (last ? i >= 0 : i + 32 <= n) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + qlen - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, f),
+                                                                  _mm256_cmpeq_epi8(b, l)));
+        while (mask) {
+            int bit = last ? 31 - __builtin_clz(mask) : __builtin_ctz(mask);
+            if (qlen <= 2 || memcmp(p + i + bit + 1, q + 1, qlen - 2) == 0) {
+                return i + bit;
+            }
+            mask &= ~(1u << bit);
+        }
+        i += last ? -32 : 32;
+    }
+    long rest = last ? i + 32 : i;
+    long h = last ? searchScalar(p, rest + qlen - 1, q, qlen, 1)
+                  : searchScalar(p + rest, len - rest, q, qlen, 0);
+    return h < 0 ? -1 : (last ? h : rest + h);
+}
+#endif
+
+long searchFind(const char *p, long len, const char *q, int qlen, int last) {
+    if (len < qlen) {
+        return -1;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        return searchAVX2(p, len, q, qlen, last);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return searchSSE2(p, len, q, qlen, last);
+    }
+#endif
+    return searchScalar(p, len, q, qlen, last);
+}
+
+// the largest subtree around row that is still one stretch of the file,
+// NULL if row itself was edited. Searching it is a single scan of the map
+rowNode *searchRegion(erow *row) {
+    rowNode *n = (rowNode *)row;
+    if (n->span == NULL) {
+        return NULL;
+    }
+    while (n->parent && n->parent->span) {
+        n = n->parent;
+    }
+    return n;
+}
+
+// turns a pointer into the region (or into row when there is none) back
+// into a row and column
+void searchLocate(rowNode *region, erow *row, int first, const char *p, int *r, int *c) {
+    if (region == NULL) {
+        *r = first;
+        *c = p - row->chars;
+        return;
+    }
+    *r = first + ropeLocate(region, p - region->span, c);
+}
+
+// looks for the first match of q (or the last, dir < 0) that starts between
+// (r, c) and (er, ec), er == E.numrows standing for the end. Returns 1 with
+// it in *mr, *mc, or 0. Every CRATE_SEARCH_SLICE bytes it checks for input,
+// and if a key is waiting returns -1 with where to pick up in *mr, *mc:
+// the new (r, c) going forwards, the new (er, ec) going backwards
+int editorSearchRange(const char *q, int qlen, int dir, int r, int c, int er, int ec,
+                      int *mr, int *mc) {
+    long long scanned = 0;
+    if (dir < 0 && er >= E.numrows) {
+        er = E.numrows - 1;
+        ec = er >= 0 ? editorRowAt(er)->size : 0;
+    }
+    int at = dir > 0 ? r : er;
+    erow *row = editorRowAt(at);
+    while (row && (dir > 0 ? (at < er || (at == er && c < ec)) : (at > r || (at == r && ec > c)))) {
+        rowNode *region = searchRegion(row);
+        int first = region ? at - ropeRank((rowNode *)row, region) : at;
+        int last = region ? first + region->count - 1 : at;
+
+        // the bytes matches have to lie in: from the low end, which may be
+        // part way into a row, to the high end, past which no match may start
+        const char *lo, *hi;
+        if (dir > 0) {
+            lo = row->chars + c;
+            erow *e = er <= last ? editorRowAt(er) : NULL;
+            hi = e ? e->chars + (ec + qlen - 1 < e->size ? ec + qlen - 1 : e->size)
+                   : region ? region->span + region->bytes : row->chars + row->size;
+        }
+        else {
+            hi = row->chars + (ec + qlen - 1 < row->size ? ec + qlen - 1 : row->size);
+            erow *b = r >= first ? editorRowAt(r) : NULL;
+            lo = b ? b->chars + c : region ? region->span : row->chars;
+        }
+
+        while (hi - lo >= qlen) {
+            if (region) {
+                indexNarrow(&lo, &hi, q, qlen, dir);
+                if (hi - lo < qlen) {
+                    break;
+                }
+            }
+            long slice = hi - lo > CRATE_SEARCH_SLICE + qlen - 1 ? CRATE_SEARCH_SLICE + qlen - 1 : hi - lo;
+            const char *s = dir > 0 ? lo : hi - slice;
+            long h = searchFind(s, slice, q, qlen, dir < 0);
+            if (h >= 0) {
+                searchLocate(region, row, first, s + h, mr, mc);
+                return 1;
+            }
+            // the next slice starts where this one's last match could have
+            if (dir > 0) {
+                lo = s + slice - qlen + 1;
+            }
+            else {
+                hi = s + qlen - 1;
+            }
+            scanned += slice;
+            if (scanned >= CRATE_SEARCH_SLICE) {
+                scanned = 0;
+                if (hi - lo >= qlen && editorInputReady(0)) {
+                    searchLocate(region, row, first, dir > 0 ? lo : hi - qlen + 1, mr, mc);
+                    return -1;
+                }
+            }
+        }
+
+        if (dir > 0) {
+            at = last + 1;
+            c = 0;
+            row = region ? editorRowAt(at) : editorRowNext(row);
+        }
+        else {
+            at = first - 1;
+            row = region ? editorRowAt(at) : editorRowPrev(row);
+            ec = row ? row->size : 0;
+        }
+        scanned += 64;  // walking rows is not free either
+        if (scanned >= CRATE_SEARCH_SLICE) {
+            scanned = 0;
+            if (row && editorInputReady(0)) {
+                *mr = at;
+                *mc = dir > 0 ? 0 : ec;
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// one search through the whole file from where it started, in two legs:
+// up to the end (or the start, going backwards) and then around from the
+// other end back to where it started
+struct searchScan {
+    int dir;
+    int orow, ocol;  // where it started
+    int leg;  // 2 once it is done
+    int rrow, rcol;  // where the current leg picks up
+};
+
+void searchBegin(struct searchScan *s, int dir, int row, int col) {
+    s->dir = dir;
+    s->orow = row;
+    s->ocol = col;
+    s->leg = 0;
+    s->rrow = row;
+    s->rcol = col;
+}
+
+int searchRun(struct searchScan *s, const char *q, int qlen, int *mr, int *mc) {
+    while (s->leg < 2) {
+        int ret;
+        if (s->dir > 0) {
+            int er = s->leg == 0 ? E.numrows : s->orow;
+            int ec = s->leg == 0 ? 0 : s->ocol;
+            ret = editorSearchRange(q, qlen, 1, s->rrow, s->rcol, er, ec, mr, mc);
+        }
+        else {
+            int r = s->leg == 0 ? 0 : s->orow;
+            int c = s->leg == 0 ? 0 : s->ocol;
+            ret = editorSearchRange(q, qlen, -1, r, c, s->rrow, s->rcol, mr, mc);
+        }
+        if (ret == -1) {
+            s->rrow = *mr;
+            s->rcol = *mc;
+        }
+        if (ret != 0) {
+            return ret;
+        }
+        s->leg++;
+        s->rrow = s->dir > 0 ? 0 : E.numrows;
+        s->rcol = 0;
+    }
+    return 0;
+}
+
+// called by the prompt after every key. As the query grows the scan goes on
+// from the current match, or from wherever it was cut short: nothing before
+// that can match a longer query if it did not match a shorter one
+void editorFindCallback(char *query, int key) {
+    static struct searchScan scan;
+    static int found = 0;  // 1 matched, 0 no match anywhere, -1 cut short
+    static int lastlen = -1;
+    static int startrow, startcol;
+    static int mrow, mcol;
+
+    if (key == '\r' || key == '\x1b') {
+        lastlen = -1;
+        return;
+    }
+    int qlen = strlen(query);
+    if (lastlen == -1) {
+        startrow = E.cy;
+        startcol = E.cx;
+        found = 0;
+        lastlen = 0;
+    }
+
+    if (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP) {
+        int dir = key == ARROW_RIGHT || key == ARROW_DOWN ? 1 : -1;
+        if (found == 1) {
+            searchBegin(&scan, dir, mrow, dir > 0 ? mcol + 1 : mcol);
+        }
+        else if (found == 0 || scan.dir != dir) {
+            searchBegin(&scan, dir, E.cy, E.cx);
+        }
+    }
+    else if (qlen > lastlen && found == 1) {
+        searchBegin(&scan, 1, mrow, mcol);
+    }
+    else if (qlen > lastlen && found == 0 && lastlen > 0) {
+        lastlen = qlen;  // the shorter query was nowhere, neither is this
+        return;
+    }
+    else if (qlen <= lastlen || found == 0) {
+        searchBegin(&scan, 1, startrow, startcol);
+    }
+    lastlen = qlen;
+
+    if (qlen == 0) {
+        found = 0;
+        E.cy = startrow;
+        E.cx = startcol;
+        return;
+    }
+    found = searchRun(&scan, query, qlen, &mrow, &mcol);
+    if (found == 1) {
+        E.cy = mrow;
+        E.cx = mcol;
+        E.rowoff = E.numrows;  // editorScroll brings the match to the top
+    }
+}
+
+void editorFind() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+    int saved_wrapoff = E.wrapoff;
+
+    editorGapClose();  // rows are scanned straight from chars
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    if (query) {
+        free(query);
+    }
+    else {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
+        E.wrapoff = saved_wrapoff;
+    }
+}
+
+/*** ---------- replace ---------- ***/
+
+// a replace over the whole file: the rows are cut into ranges matched on the
+// worker pool, each range building the record of its changed rows, and the
+// records are then applied in one pass and kept as one undo step
+struct replaceJob {
+    int regex;
+    const char *pat;
+    const char *with;
+    int patlen;
+    int rowsper;  // rows per task
+    struct abuf *recs;  // one record per task
+    long long *counts;  // matches replaced per task
+};
+
+// the prompt takes /old/new/ for text and s/regex/new/ for a POSIX extended
+// regex, where new may use & and \1 .. \9. Any punctuation may stand in for
+// the slash, for patterns that contain one
+int replaceParse(char *in, struct replaceJob *job) {
+    job->regex = 0;
+    if (in[0] == 's' && ispunct((unsigned char)in[1])) {
+        job->regex = 1;
+        in++;
+    }
+    if (!ispunct((unsigned char)in[0]) || in[0] == '\\') {
+        return -1;
+    }
+    char delim = *in++;
+    char *mid = strchr(in, delim);
+    if (mid == NULL || mid == in) {
+        return -1;
+    }
+    *mid = '\0';
+    char *end = strchr(mid + 1, delim);
+    if (end) {
+        *end = '\0';
+    }
+    job->pat = in;
+    job->patlen = mid - in;
+    job->with = mid + 1;
+    return 0;
+}
+
+// appends new for the match in m, filling in the groups
+void replaceExpand(struct replaceJob *job, const char *s, regmatch_t *m, struct abuf *out) {
+    const char *w;
+    for (w = job->with; *w; w++) {
+        int g = -1;
+        if (*w == '&') {
+            g = 0;
+        }
+        else if (*w == '\\' && w[1] >= '0' && w[1] <= '9') {
+            g = *++w - '0';
+        }
+        else if (*w == '\\' && w[1]) {
+            w++;
+        }
+        if (g == -1) {
+            abAppend(out, w, 1);
+        }
+        else if (m[g].rm_so != -1) {
+            abAppend(out, s + m[g].rm_so, m[g].rm_eo - m[g].rm_so);
+        }
+    }
+}
+
+// builds the new chars of row in out, returning how many matches it had
+int replaceLine(struct replaceJob *job, regex_t *re, erow *row, struct abuf *out) {
+    const char *s = row->chars;
+    int withlen = strlen(job->with);
+    int at = 0;
+    int n = 0;
+    abReset(out);
+    if (!job->regex) {
+        long h;
+        while ((h = searchFind(s + at, row->size - at, job->pat, job->patlen, 0)) >= 0) {
+            abAppend(out, s + at, h);
+            abAppend(out, job->with, withlen);
+            at += h + job->patlen;
+            n++;
+        }
+    }
+    else {
+        // rows are not terminated, so the match is bounded with REG_STARTEND
+        regmatch_t m[10];
+        int eflags = REG_STARTEND;
+        int lastend = -1;
+        while (at <= row->size) {
+            m[0].rm_so = at;
+            m[0].rm_eo = row->size;
+            if (regexec(re, s, 10, m, eflags) != 0) {
+                break;
+            }
+            abAppend(out, s + at, m[0].rm_so - at);
+            // like sed, no empty match right where the last one ended
+            if (m[0].rm_eo > m[0].rm_so || m[0].rm_so != lastend) {
+                replaceExpand(job, s, m, out);
+                lastend = m[0].rm_eo;
+                n++;
+            }
+            eflags |= REG_NOTBOL;
+            at = m[0].rm_eo;
+            if (m[0].rm_eo == m[0].rm_so) {
+                // an empty match: keep the char after it and move on
+                if (at < row->size) {
+                    abAppend(out, s + at, 1);
+                }
+                at++;
+            }
+        }
+    }
+    if (n > 0 && at < row->size) {
+        abAppend(out, s + at, row->size - at);
+    }
+    return n;
+}
+
+void replaceTask(int task, void *arg) {
+    struct replaceJob *job = arg;
+    int y = task * job->rowsper;
+    int end = y + job->rowsper < E.numrows ? y + job->rowsper : E.numrows;
+    // a regex_t each: glibc serializes regexec calls sharing one
+    regex_t re;
+    if (job->regex && regcomp(&re, job->pat, REG_EXTENDED) != 0) {
+        return;
+    }
+    struct abuf *rec = &job->recs[task];
+    struct abuf out = {NULL, 0, 0};
+    erow *row = y < end ? editorRowAt(y) : NULL;
+    for (; y < end; y++, row = editorRowNext(row)) {
+        int n = replaceLine(job, job->regex ? &re : NULL, row, &out);
+        if (n == 0) {
+            continue;
+        }
+        int h[3] = {y, row->size, out.len};
+        abAppend(rec, (char *)h, sizeof(h));
+        abAppend(rec, row->chars, row->size);
+        abAppend(rec, out.b, out.len);
+        job->counts[task] += n;
+    }
+    abFree(&out);
+    if (job->regex) {
+        regfree(&re);
+    }
+}
+
+void editorReplace() {
+    char *in = editorPrompt("Replace: %s (/old/new/ or s/regex/new/)", NULL);
+    if (in == NULL) {
+        return;
+    }
+    struct replaceJob job;
+    if (replaceParse(in, &job) == -1) {
+        editorSetStatusMessage("Replace takes /old/new/ or s/regex/new/");
+        free(in);
+        return;
+    }
+    if (job.regex) {
+        regex_t re;
+        int err = regcomp(&re, job.pat, REG_EXTENDED);
+        if (err != 0) {
+            char msg[80];
+            regerror(err, &re, msg, sizeof(msg));
+            editorSetStatusMessage("Bad regex: %s", msg);
+            free(in);
+            return;
+        }
+        regfree(&re);
+    }
+
+    long long t = traceNow();
+    editorGapClose();  // rows are matched straight from chars
+    int ntasks = editorWorkerCount() * 4;
+    if (ntasks > E.numrows) {
+        ntasks = E.numrows > 0 ? E.numrows : 1;
+    }
+    job.rowsper = (E.numrows + ntasks - 1) / ntasks;
+    job.recs = calloc(ntasks, sizeof(struct abuf));
+    job.counts = calloc(ntasks, sizeof(long long));
+    if (job.recs == NULL || job.counts == NULL) {
+        die("calloc");
+    }
+    editorParallelFor(ntasks, replaceTask, &job);
+
+    // one record for the whole replace, in row order
+    size_t len = 0;
+    long long count = 0;
+    int j;
+    for (j = 0; j < ntasks; j++) {
+        len += job.recs[j].len;
+        count += job.counts[j];
+    }
+    char *rec = malloc(len + 1);
+    if (rec == NULL) {
+        die("malloc");
+    }
+    size_t at = 0;
+    for (j = 0; j < ntasks; j++) {
+        // a task that matched nothing never allocated its buffer
+        if (job.recs[j].len > 0) {
+            memcpy(rec + at, job.recs[j].b, job.recs[j].len);
+            at += job.recs[j].len;
+        }
+        abFree(&job.recs[j]);
+    }
+    rec[len] = '\0';
+    free(job.recs);
+    free(job.counts);
+    free(in);
+
+    if (count == 0) {
+        free(rec);
+        editorSetStatusMessage("No match");
+        return;
+    }
+    // the first and last rows it changed
+    int h[3];
+    int y = -1, ey = -1;
+    for (at = 0; at + sizeof(h) <= len; at += sizeof(h) + h[1] + h[2]) {
+        memcpy(h, rec + at, sizeof(h));
+        if (y == -1) {
+            y = h[0];
+        }
+        ey = h[0];
+    }
+    int dirty = E.dirty;
+    editorReplaceRows(rec, len, 0);
+    undoRecordReplace(y, ey, rec, len);
+    editorSetStatusMessage("Replaced %lld matches on %d lines in %.0f ms", count,
+                           E.dirty - dirty, (traceNow() - t) / 1e6);
+}
+
+/*** ---------- append buffer ---------- ***/
+
+void abReserve(struct abuf *ab, int extra) {
+    if (ab->len + extra <= ab->cap) {
+        return;
+    }
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + extra) {
+        cap *= 2;
+    }
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) {
+        die("realloc");
+    }
+    ab->b = new;
+    ab->cap = cap;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+    if (len <= 0) {
+        return;
+    }
+    abReserve(ab, len);
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
+
+// n copies of c, for padding
+void abFill(struct abuf *ab, char c, int n) {
+    if (n <= 0) {
+        return;
+    }
+    abReserve(ab, n);
+    memset(&ab->b[ab->len], c, n);
+    ab->len += n;
+}
+
+void abReset(struct abuf *ab) {
+    ab->len = 0;
+}
+
+// writes everything out, picking up after short writes and interrupts
+int abFlush(struct abuf *ab, int fd) {
+    int off = 0;
+    while (off < ab->len) {
+        ssize_t n = write(fd, ab->b + off, ab->len - off);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        off += n;
+    }
+    E.outbytes += ab->len;
+    ab->len = 0;
+    return 0;
+}
+
+void abFree(struct abuf *ab) {
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
+}
+
+/*** ---------- syntax highlighting ---------- ***/
+
+// every row keeps the lexer state it starts and ends in. Only rows about to
+// be drawn are highlighted; to know the state the first of them starts in,
+// rows above it are lexed once and then passed over for as long as their
+// chars are unchanged and they start in the state they were lexed from, so
+// an edit costs the rows from it down to where the states agree again
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".cc", ".hpp", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+    "do", "goto", "sizeof", "extern", "const", "volatile", "inline",
+
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "size_t|", NULL
+};
+
+struct editorSyntax HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+void syntaxInvalidate(int y) {
+    if (y < E.hlvalid) {
+        E.hlvalid = y;
+    }
+}
+
+// called whenever the chars of row change
+void syntaxRowChanged(erow *row) {
+    row->flags &= ~ROW_HL;
+    if (E.syntax && E.hlvalid > 0) {
+        syntaxInvalidate(ropeRank((rowNode *)row, NULL));
+    }
+}
+
+int syntaxIsSeparator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}&|^!?:", c) != NULL;
+}
+
+// whether the word kw starts at i and ends there
+int syntaxMatchAt(erow *row, int i, const char *kw, int klen) {
+    int j;
+    if (i + klen > row->size) {
+        return 0;
+    }
+    for (j = 0; j < klen; j++) {
+        if (editorRowChar(row, i + j) != kw[j]) {
+            return 0;
+        }
+    }
+    return i + klen == row->size || syntaxIsSeparator(editorRowChar(row, i + klen));
+}
+
+// lexes row from state, filling hl[rx] for every render column when hl is
+// not NULL, or for a row that is not ASCII hl[j] for every byte of chars.
+// Returns the state the row ends in
+int syntaxLexRow(erow *row, int state, unsigned char *hl) {
+    char **keywords = E.syntax->keywords;
+    int bytes = hl && !editorRowIsAscii(row);
+    int prevsep = 1;
+    int prevhl = HL_NORMAL;
+    int lead = 1;  // nothing but blanks so far
+    int rx = 0;
+    int i = 0;
+    while (i < row->size) {
+        char c = editorRowChar(row, i);
+        char next = i + 1 < row->size ? editorRowChar(row, i + 1) : '\0';
+        int cls = HL_NORMAL;
+        int n = 1;
+        if (state == SYN_COMMENT) {
+            cls = HL_COMMENT;
+            if (c == '*' && next == '/') {
+                n = 2;
+                state = SYN_CODE;
+            }
+        }
+        else if (state == SYN_LINE_COMMENT) {
+            cls = HL_COMMENT;
+        }
+        else if (state == SYN_STRING) {
+            cls = HL_STRING;
+            if (c == '\\' && next) {
+                n = 2;
+            }
+            else if (c == '"') {
+                state = SYN_CODE;
+            }
+        }
+        else if (c == '/' && next == '/') {
+            cls = HL_COMMENT;
+            state = SYN_LINE_COMMENT;
+        }
+        else if (c == '/' && next == '*') {
+            cls = HL_COMMENT;
+            n = 2;
+            state = SYN_COMMENT;
+        }
+        else if (state == SYN_PREPROC) {
+            cls = HL_PREPROC;
+        }
+        else if (c == '#' && lead) {
+            cls = HL_PREPROC;
+            state = SYN_PREPROC;
+        }
+        else if (c == '"') {
+            cls = HL_STRING;
+            state = SYN_STRING;
+        }
+        else if (c == '\'') {
+            // char constants never run past the row
+            cls = HL_STRING;
+            while (i + n < row->size) {
+                char d = editorRowChar(row, i + n);
+                n += d == '\\' && i + n + 1 < row->size ? 2 : 1;
+                if (d == '\'') {
+                    break;
+                }
+            }
+        }
+        else if ((isdigit((unsigned char)c) && (prevsep || prevhl == HL_NUMBER)) ||
+                 ((c == '.' || isalnum((unsigned char)c)) && prevhl == HL_NUMBER)) {
+            cls = HL_NUMBER;
+        }
+        else if (prevsep && (isalpha((unsigned char)c) || c == '_')) {
+            int j;
+            for (j = 0; keywords[j]; j++) {
+                int klen = strlen(keywords[j]);
+                int kw2 = keywords[j][klen - 1] == '|';
+                if (kw2) {
+                    klen--;
+                }
+                if (syntaxMatchAt(row, i, keywords[j], klen)) {
+                    cls = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+                    n = klen;
+                    break;
+                }
+            }
+        }
+
+        int j;
+        for (j = 0; j < n; j++) {
+            c = editorRowChar(row, i + j);
+            if (hl && bytes) {
+                hl[i + j] = cls;
+            }
+            else if (hl) {
+                int end = editorNextRx(rx, c);
+                while (rx < end) {
+                    hl[rx++] = cls;
+                }
+            }
+        }
+        if (!isspace((unsigned char)c)) {
+            lead = 0;
+        }
+        prevsep = syntaxIsSeparator((unsigned char)c);
+        prevhl = cls;
+        i += n;
+    }
+
+    // only comments, strings and directives ending in a backslash go on
+    int cont = row->size > 0 && editorRowChar(row, row->size - 1) == '\\';
+    if ((state == SYN_LINE_COMMENT || state == SYN_PREPROC || state == SYN_STRING) && !cont) {
+        state = SYN_CODE;
+    }
+    return state;
+}
+
+// the state a row ends in, as syntaxLexRow finds it but looking only at
+// what can change the state, straight over chars
+int syntaxScanRow(erow *row, int state) {
+    if (row == E.gaprow) {
+        return syntaxLexRow(row, state, NULL);
+    }
+    const char *s = row->chars;
+    int size = row->size;
+    int lead = 0;  // where the first char that is not a blank is
+    while (lead < size && isspace((unsigned char)s[lead])) {
+        lead++;
+    }
+    int i = 0;
+    while (i < size && state != SYN_LINE_COMMENT) {
+        char c = s[i];
+        char next = i + 1 < size ? s[i + 1] : '\0';
+        if (state == SYN_COMMENT) {
+            if (c == '*' && next == '/') {
+                state = SYN_CODE;
+                i++;
+            }
+        }
+        else if (state == SYN_STRING) {
+            if (c == '\\' && next) {
+                i++;
+            }
+            else if (c == '"') {
+                state = SYN_CODE;
+            }
+        }
+        else if (c == '/' && next == '/') {
+            state = SYN_LINE_COMMENT;
+        }
+        else if (c == '/' && next == '*') {
+            state = SYN_COMMENT;
+            i++;
+        }
+        else if (state == SYN_PREPROC) {
+            // only a comment ends a directive early
+        }
+        else if (c == '#' && i == lead) {
+            state = SYN_PREPROC;
+        }
+        else if (c == '"') {
+            state = SYN_STRING;
+        }
+        else if (c == '\'') {
+            while (i + 1 < size) {
+                char d = s[++i];
+                if (d == '\\' && i + 1 < size) {
+                    i++;
+                }
+                else if (d == '\'') {
+                    break;
+                }
+            }
+        }
+        i++;
+    }
+
+    int cont = size > 0 && s[size - 1] == '\\';
+    if ((state == SYN_LINE_COMMENT || state == SYN_PREPROC || state == SYN_STRING) && !cont) {
+        state = SYN_CODE;
+    }
+    return state;
+}
+
+// the state row, the y-th, starts in, catching E.hlvalid up to it
+int syntaxStartState(erow *row, int y) {
+    if (y == 0) {
+        return SYN_CODE;
+    }
+    if (y <= E.hlvalid) {
+        return editorRowPrev(row)->hlout;
+    }
+    int k = E.hlvalid;
+    int state = k == 0 ? SYN_CODE : editorRowAt(k - 1)->hlout;
+    for (row = editorRowAt(k); k < y; k++, row = editorRowNext(row)) {
+        if (!(row->flags & ROW_HL) || row->hlin != state) {
+            row->hlin = state;
+            row->hlout = syntaxScanRow(row, state);
+            row->flags |= ROW_HL;
+        }
+        state = row->hlout;
+    }
+    E.hlvalid = y;
+    return state;
+}
+
+// fills E.hl for row y, about to be drawn
+void syntaxHighlightRow(erow *row, int y) {
+    int need = editorRowIsAscii(row) ? row->rsize : row->size;
+    if (need > E.hlcap) {
+        E.hlcap = need * 2;
+        E.hl = realloc(E.hl, E.hlcap);
+        if (E.hl == NULL) {
+            die("realloc");
+        }
+    }
+    int state = syntaxStartState(row, y);
+    row->hlin = state;
+    row->hlout = syntaxLexRow(row, state, E.hl);
+    row->flags |= ROW_HL;
+    if (E.hlvalid == y) {
+        E.hlvalid = y + 1;
+    }
+}
+
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        case HL_PREPROC: return 34;
+        default: return 37;
+    }
+}
+
+void editorSelectSyntaxHighlight() {
+    struct editorSyntax *old = E.syntax;
+    E.syntax = NULL;
+    E.hlvalid = 0;
+    if (E.filename != NULL) {
+        char *ext = strrchr(E.filename, '.');
+        unsigned int j;
+        for (j = 0; j < HLDB_ENTRIES && E.syntax == NULL; j++) {
+            struct editorSyntax *s = &HLDB[j];
+            int i;
+            for (i = 0; s->filematch[i]; i++) {
+                int is_ext = s->filematch[i][0] == '.';
+                if ((is_ext && ext && strcmp(ext, s->filematch[i]) == 0) ||
+                    (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                    E.syntax = s;
+                    break;
+                }
+            }
+        }
+    }
+    // states lexed for another language mean nothing in this one
+    if (old && E.syntax != old) {
+        erow *row;
+        for (row = editorRowAt(0); row; row = editorRowNext(row)) {
+            row->flags &= ~ROW_HL;
+        }
+    }
+}
+
+/*** ---------- soft wrap ---------- ***/
+
+// with soft wrap on, a row takes as many screen lines as it needs at
+// E.screencols columns each. Every row keeps its width and line count, and
+// the row treap sums the counts, so going between rows and screen lines is
+// O(log n). Edits only mark rows stale; the next frame lays out just those
+
+// lays out a row that may hold double width chars, where a wide char the
+// right edge would cut starts the next line instead. Goes on from p until
+// line k starts or char cx comes up, whichever is first
+void editorRowWrapWalk(erow *row, struct wrapPos *p, int k, int cx) {
+    while (p->line < k && p->j < row->size) {
+        int w;
+        int len = editorRowDecode(row, p->j, p->at, &w);
+        // a tab is the one char split across lines
+        int tab = editorRowChar(row, p->j) == '\t';
+        if (p->x + w > E.screencols && p->x > 0 && (!tab || p->x == E.screencols)) {
+            p->line++;
+            p->x = 0;
+            if (p->line == k) {
+                break;
+            }
+        }
+        if (p->j >= cx) {
+            break;
+        }
+        p->j += len;
+        p->at += w;
+        p->x += w;
+        while (p->x > E.screencols && p->line < k) {
+            p->line++;
+            p->x -= E.screencols;
+        }
+    }
+}
+
+// the checkpoint to start walking a wrapped row from for line k or char
+// cx: the last one on or before both. Like rx checkpoints they are filled
+// in on demand, and dropped from an edit on or when the width changes
+int editorRowWrapCheckpoint(erow *row, int k, int cx) {
+    struct renderSlot *slot = &E.rcache[row->rslot];
+    int upto = (cx < row->size ? cx : row->size) / CRATE_RX_CHECKPOINT;
+    editorRowCheckpoints(row, 0);
+    if (slot->wcols != E.screencols) {
+        slot->nwcps = 0;
+        slot->wcols = E.screencols;
+    }
+    if (upto >= slot->wcpcap) {
+        slot->wcpcap = upto + 1 > slot->wcpcap * 2 ? upto + 1 : slot->wcpcap * 2;
+        slot->wcps = realloc(slot->wcps, sizeof(int) * 2 * slot->wcpcap);
+        if (slot->wcps == NULL) {
+            die("realloc");
+        }
+    }
+    if (slot->nwcps == 0) {
+        slot->wcps[0] = 0;
+        slot->wcps[1] = 0;
+        slot->nwcps = 1;
+    }
+
+    // rx checkpoints are only filled in as far as the walk goes, so that
+    // stopping at line k does not cost the rest of the row
+    while (slot->nwcps <= upto && slot->wcps[2 * (slot->nwcps - 1)] <= k) {
+        int i = slot->nwcps - 1;
+        editorRowCheckpoints(row, i);
+        struct wrapPos p = {editorRowBoundary(row, i * CRATE_RX_CHECKPOINT), slot->cps[i],
+                            slot->wcps[2 * i + 1], slot->wcps[2 * i]};
+        editorRowWrapWalk(row, &p, INT_MAX, editorRowBoundary(row, (i + 1) * CRATE_RX_CHECKPOINT));
+        slot->wcps[2 * i + 2] = p.line;
+        slot->wcps[2 * i + 3] = p.x;
+        slot->nwcps++;
+        if (slot->ncps == i + 1 && i + 1 < slot->cpcap) {
+            slot->cps[slot->ncps++] = p.at;  // the walk ended on the next one
+        }
+    }
+
+    int lo = 0;
+    int hi = upto < slot->nwcps - 1 ? upto : slot->nwcps - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (slot->wcps[2 * mid] <= k) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    if (lo > 0 && editorRowBoundary(row, lo * CRATE_RX_CHECKPOINT) > cx) {
+        lo--;
+    }
+    editorRowCheckpoints(row, lo);
+    return lo;
+}
+
+// lays out a ROW_WIDE row up to line k or char cx. The column line p->line
+// starts at is p->at - p->x
+void editorRowWrapPos(erow *row, int k, int cx, struct wrapPos *p) {
+    p->j = 0;
+    p->at = 0;
+    p->x = 0;
+    p->line = 0;
+    editorRowKeepCheckpoints(row);
+    if (row->rslot != -1) {
+        struct renderSlot *slot = &E.rcache[row->rslot];
+        int i = editorRowWrapCheckpoint(row, k, cx);
+        p->j = editorRowBoundary(row, i * CRATE_RX_CHECKPOINT);
+        p->at = slot->cps[i];
+        p->line = slot->wcps[2 * i];
+        p->x = slot->wcps[2 * i + 1];
+    }
+    editorRowWrapWalk(row, p, k, cx);
+}
+
+int editorRowWrapLines(erow *row) {
+    if (row->flags & ROW_WIDE) {
+        struct wrapPos p;
+        editorRowWrapPos(row, INT_MAX, INT_MAX, &p);
+        return p.line + 1;
+    }
+    return row->cols > E.screencols ? (row->cols + E.screencols - 1) / E.screencols : 1;
+}
+
+void editorRowLayout(erow *row) {
+    row->flags &= ~(ROW_WIDE | ROW_TAIL);
+    if (row->rslot != -1) {
+        E.rcache[row->rslot].wide = -1;  // counted below if it is walked
+    }
+    if (row->flags & ROW_RAW || row->render) {
+        row->cols = row->rsize;
+    }
+    else if (editorRowIsAscii(row)) {
+        int j = 0;
+        row->cols = editorRowNeedsExpansion(row) ? editorRowWalk(row, &j, row->size, 0) : row->size;
+    }
+    else {
+        int j = 0;
+        int rx = 0;
+        int wide = 0;
+        int lasttab = -1;
+        while (j < row->size) {
+            int w;
+            int len = editorRowDecode(row, j, rx, &w);
+            if (editorRowChar(row, j) == '\t') {
+                lasttab = j;
+            }
+            else if (w > 1) {
+                wide++;
+            }
+            j += len;
+            rx += w;
+        }
+        row->cols = rx;
+        if (wide > 0) {
+            row->flags |= ROW_WIDE;
+        }
+        // long rows keep the counts, so that typing into them patches the
+        // layout instead of walking the whole row again
+        editorRowKeepCheckpoints(row);
+        if (row->rslot != -1) {
+            E.rcache[row->rslot].wide = wide;
+            E.rcache[row->rslot].lasttab = lasttab;
+        }
+    }
+    row->lines = editorRowWrapLines(row);
+}
+
+// the double width chars among those that start in [from, to) of a row,
+// and in *cols the columns they all cover
+int editorRowSpanWide(erow *row, int from, int to, int *cols) {
+    int j = editorRowBoundary(row, from > 0 ? from : 0);
+    int wide = 0;
+    *cols = 0;
+    while (j < to && j < row->size) {
+        int w;
+        j += editorRowDecode(row, j, *cols, &w);
+        wide += w > 1;
+        *cols += w;
+    }
+    return wide;
+}
+
+// the last tab among chars [0, at) of a row, -1 if there is none
+int editorRowTabBefore(erow *row, int at) {
+    char *t = NULL;
+    if (row == E.gaprow && at > E.gapstart) {
+        t = memrchr(row->chars + E.gapstart + E.gaplen, '\t', at - E.gapstart);
+        if (t) {
+            return t - row->chars - E.gaplen;
+        }
+        at = E.gapstart;
+    }
+    t = memrchr(row->chars, '\t', at);
+    return t ? t - row->chars : -1;
+}
+
+// the first tab among chars [at, size) of a row, -1 if there is none
+int editorRowTabAfter(erow *row, int at) {
+    char *t = NULL;
+    if (row == E.gaprow && at < E.gapstart) {
+        t = memchr(row->chars + at, '\t', E.gapstart - at);
+        if (t) {
+            return t - row->chars;
+        }
+        at = E.gapstart;
+    }
+    int skip = row == E.gaprow ? E.gaplen : 0;
+    t = memchr(row->chars + at + skip, '\t', row->size - at);
+    return t ? t - row->chars - skip : -1;
+}
+
+// a one byte edit at at of a long row that is not ASCII can only change
+// how the chars starting within three bytes of it decode: every other char
+// keeps its width. Without a tab past the edit, whose width depends on where
+// it starts, the row is one more or less of those columns. With one, the
+// old and new rows agree past the first tab after the chars the edit can
+// reach, so their columns are compared there. That is only as far as the
+// render patch for ASCII rows walks, and is taken before the edit is made
+void editorRowLayoutBefore(erow *row, int at, int c, int inserted, struct layoutEdit *le) {
+    le->cols = -1;
+    if (row->cols < 0 || row->render || row->rslot == -1 || E.rcache[row->rslot].wide < 0) {
+        return;
+    }
+    struct renderSlot *slot = &E.rcache[row->rslot];
+    le->cols = row->cols;
+    le->wide = editorRowSpanWide(row, at - 3, inserted ? at + 3 : at + 4, &le->span);
+    le->anchor = -1;
+    if (slot->lasttab >= at || c == '\t') {
+        int q = editorRowBoundary(row, at + 4 < row->size ? at + 4 : row->size);
+        if (slot->lasttab >= q) {
+            q = editorRowTabAfter(row, q) + 1;
+        }
+        le->anchor = q;
+        le->rx = editorRowCxToRx(row, q);
+    }
+}
+
+// wide chars move every line break after them, so a row holding any is
+// left to editorRowLayoutTail
+void editorRowLayoutAfter(erow *row, int at, int c, int inserted, struct layoutEdit *le) {
+    if (le->cols < 0 || row->rslot == -1) {
+        return;
+    }
+    struct renderSlot *slot = &E.rcache[row->rslot];
+    int span;
+    slot->wide += editorRowSpanWide(row, at - 3, inserted ? at + 4 : at + 3, &span) - le->wide;
+    if (inserted && c == '\t' && at > slot->lasttab) {
+        slot->lasttab = at;
+    }
+    else if (at <= slot->lasttab) {
+        slot->lasttab += inserted ? 1 : -1;
+        if (!inserted && at == slot->lasttab + 1) {
+            slot->lasttab = editorRowTabBefore(row, at);  // it was the last tab
+        }
+    }
+    if (le->anchor < 0) {
+        row->cols = le->cols + span - le->span;
+    }
+    else {
+        row->cols = le->cols + editorRowCxToRx(row, le->anchor + (inserted ? 1 : -1)) - le->rx;
+    }
+    if (slot->wide > 0) {
+        row->flags |= ROW_WIDE | ROW_TAIL;  // lines is a guess till it is laid out
+    }
+    else {
+        row->flags &= ~ROW_WIDE;
+        row->lines = editorRowWrapLines(row);
+    }
+}
+
+// the column screen line k of a row starts at
+int editorRowLineStart(erow *row, int k) {
+    if (row->flags & ROW_WIDE) {
+        struct wrapPos p;
+        editorRowWrapPos(row, k, INT_MAX, &p);
+        return p.at - p.x;
+    }
+    return k * E.screencols;
+}
+
+// which of its screen lines char cx of a row is on, and in *col where
+// along that line
+int editorRowLineOf(erow *row, int cx, int *col) {
+    if (row->flags & ROW_WIDE) {
+        struct wrapPos p;
+        editorRowWrapPos(row, INT_MAX, cx, &p);
+        *col = p.x;
+        return p.line;
+    }
+    int rx = editorRowCxToRx(row, cx);
+    int k = rx / E.screencols;
+    if (k >= row->lines) {
+        k = row->lines - 1;  // the cursor past a full last line
+    }
+    *col = rx - k * E.screencols;
+    return k;
+}
+
+// lays out a ROW_TAIL row. The row the cursor is in is only walked a
+// couple of screens past the cursor, as far as scrolling or paging from it
+// can reach, and stays a guess past that. Rows below are placed by that
+// guess until the cursor leaves it, when it is walked to the end
+void editorRowLayoutTail(erow *row, int cursor) {
+    int k = INT_MAX;
+    if (cursor) {
+        int col;
+        k = editorRowLineOf(row, E.cx < row->size ? E.cx : row->size, &col) + 2 * E.screenrows;
+    }
+    struct wrapPos p;
+    editorRowWrapPos(row, k, INT_MAX, &p);
+    if (p.line < k) {
+        row->lines = p.line + 1;
+        row->flags &= ~ROW_TAIL;
+    }
+    else if (row->lines <= k) {
+        row->lines = k + 1;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
+// lays out again the rows that changed since the last frame, only going
+// into subtrees that hold one
+void ropeLayout(rowNode *n, erow *cur) {
+    if (n == NULL || !n->stale) {
+        return;
     }
-    else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+    ropeLayout(n->left, cur);
+    ropeLayout(n->right, cur);
+    if (n->row.cols < 0) {
+        editorRowLayout(&n->row);
     }
-    E.cy++;
-    E.cx = 0;
+    else if (n->row.flags & ROW_TAIL) {
+        editorRowLayoutTail(&n->row, &n->row == cur);
+    }
+    ropePull(n);
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) {
+// at a new screen width every row wraps differently. Widths still hold,
+// so only rows with wide chars are walked again
+void ropeRewrap(rowNode *n) {
+    if (n == NULL) {
         return;
     }
-    if (E.cx == 0 && E.cy == 0) {
-        return;
+    ropeRewrap(n->left);
+    ropeRewrap(n->right);
+    if (n->row.cols < 0) {
+        editorRowLayout(&n->row);
     }
+    else {
+        n->row.flags &= ~ROW_TAIL;
+        n->row.lines = editorRowWrapLines(&n->row);
+    }
+    ropePull(n);
+}
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+void editorWrapLayout() {
+    if (E.wrapcols != E.screencols) {
+        E.wrapcols = E.screencols;
+        ropeRewrap(E.rows);
     }
     else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        ropeLayout(E.rows, editorRowAt(E.cy));
     }
 }
 
-/*** ---------- file i/o ---------- ***/
+// the screen line the cursor is on, counted from the top of the file,
+// with where along it in *col
+int editorWrapCursor(int *col) {
+    erow *row = editorRowAt(E.cy);
+    *col = 0;
+    if (row == NULL) {
+        return ropeLines(E.rows);
+    }
+    int cx = E.cx < row->size ? E.cx : row->size;
+    return ropeLinesBefore(E.cy) + editorRowLineOf(row, cx, col);
+}
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++) {
-        totlen += E.row[j].size + 1;  //+1 for newlines
+void editorWrapScroll() {
+    editorWrapLayout();
+    E.coloff = 0;
+    int col;
+    int cur = editorWrapCursor(&col);
+    erow *top = editorRowAt(E.rowoff);
+    if (top == NULL) {
+        E.rowoff = E.numrows;
+        E.wrapoff = 0;
+    }
+    else if (E.wrapoff >= top->lines) {
+        E.wrapoff = top->lines - 1;
     }
-    *buflen = totlen;
+    int first = ropeLinesBefore(E.rowoff) + E.wrapoff;
+    if (cur < first) {
+        first = cur;
+    }
+    if (cur >= first + E.screenrows) {
+        first = cur - E.screenrows + 1;
+    }
+    E.rowoff = ropeLocateLine(first, &E.wrapoff);
+    E.cury = cur - first;
+    E.curx = col;
+}
 
-    char* buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+// moves the cursor n screen lines down, or up when negative, keeping how
+// far along its line it is
+void editorWrapMove(int n) {
+    editorWrapLayout();
+    int col;
+    int from = editorWrapCursor(&col);
+    int v = from + n;
+    int total = ropeLines(E.rows);
+    if (v < 0) {
+        v = 0;
+    }
+    if (v > total) {
+        v = total;
     }
+    int k;
+    E.cy = ropeLocateLine(v, &k);
+    E.cx = 0;
+    erow *row = editorRowAt(E.cy);
+    if (row == NULL) {
+        return;
+    }
+    E.cx = editorRowRxToCx(row, editorRowLineStart(row, k) + col);
+    // no char starts on a line holding only the end of a tab, or a blank
+    // left by a wide char that did not fit, so the char found may be on the
+    // line before or after. Its neighbour is taken instead if that one is
+    // on line k, or if the cursor would not have moved at all
+    int at;
+    int line = editorRowLineOf(row, E.cx, &at);
+    if (line != k) {
+        int alt = line > k ? (E.cx > 0 ? editorRowPrevGrapheme(row, E.cx) : 0)
+                           : (E.cx < row->size ? editorRowNextGrapheme(row, E.cx) : E.cx);
+        int moved = v - k + line - from;
+        if (editorRowLineOf(row, alt, &at) == k || (n > 0 ? moved <= 0 : moved >= 0)) {
+            E.cx = alt;
+        }
+    }
+}
 
-    return buf;
+void editorToggleWrap() {
+    E.wrap = !E.wrap;
+    E.wrapoff = 0;
+    E.coloff = 0;
+    E.framevalid = 0;
+    editorSetStatusMessage("soft wrap %s", E.wrap ? "on" : "off");
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+/*** ---------- OUTPUT ---------- ***/
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        die("fopen");
+void editorScroll() {
+    E.rx = 0;
+    if (E.cy < E.numrows) {
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
+    }
+    if (E.wrap) {
+        editorWrapScroll();
+        return;
     }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        if (linelen != -1) {
-            while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                                line[linelen - 1] == '\r')) {
-                linelen--;
-            }
-            
-            editorInsertRow(E.numrows, line, linelen);
-        }
+    if (E.cy < E.rowoff) {
+        E.rowoff = E.cy;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    if (E.cy >= E.rowoff + E.screenrows) {
+        E.rowoff = E.cy - E.screenrows + 1;
+    }
+
+    if (E.rx < E.coloff) {
+        E.coloff = E.rx;
+    }
+    if (E.rx >= E.coloff + E.screencols) {
+        E.coloff = E.rx - E.screencols + 1;
+    }
+    E.cury = E.cy - E.rowoff;
+    E.curx = E.rx - E.coloff;
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s");
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
+// appends chars [at, at + len) of a row, stepping over the gap if it has one
+void abAppendRow(struct abuf *ab, erow *row, int at, int len) {
+    if (row == E.gaprow && at + len > E.gapstart) {
+        if (at < E.gapstart) {
+            abAppend(ab, &row->chars[at], E.gapstart - at);
+            len -= E.gapstart - at;
+            at = E.gapstart;
         }
+        at += E.gaplen;
     }
+    abAppend(ab, &row->chars[at], len);
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
-
-    // O_CREAT - create new file if does not exist
-    // O_RDWR - open for reading and writing
-    // 0644 - gives standard file permissions
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) != -1) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
+// appends columns [coloff, coloff + E.screencols) of a row that is not all
+// ASCII, decoding its chars on the way. hl, when given, has a color for
+// every byte. Wide chars cut by either edge leave blanks. Returns the
+// column of the first char not drawn in full, where a wrapped line after
+// this one starts
+int abAppendDecoded(struct abuf *ab, erow *row, unsigned char *hl, int coloff) {
+    int end = coloff + E.screencols;
+    int color = HL_NORMAL;
+    int shown = 0;  // marks are only drawn on a char that was
+    int rx;
+    int j = editorRowSeekRx(row, coloff, &rx);
+    while (j < row->size && rx <= end) {
+        int w;
+        int len = editorRowDecode(row, j, rx, &w);
+        unsigned char c = editorRowChar(row, j);
+        if (w == 0 ? !shown : rx + w <= coloff) {
+            shown = 0;
+        }
+        else if (rx < coloff) {
+            abFill(ab, ' ', (rx + w < end ? rx + w : end) - coloff);
+            shown = 0;
+            if (rx + w > end) {
+                rx = end;  // a tab running over the whole line
+                break;
             }
         }
-        close(fd);
+        else if (rx + w > end) {
+            abFill(ab, ' ', end - rx);
+            if (c == '\t') {
+                rx = end;  // the rest of it goes on the next line
+            }
+            break;
+        }
+        else {
+            int cls = hl ? hl[j] : HL_NORMAL;
+            if (cls != color) {
+                char buf[16];
+                int n = snprintf(buf, sizeof(buf), "\x1b[%dm",
+                                 cls == HL_NORMAL ? 39 : editorSyntaxToColor(cls));
+                abAppend(ab, buf, n);
+                color = cls;
+            }
+            if (c == '\t') {
+                abFill(ab, ' ', w);
+            }
+            else if (len == 1 && (c & 0x80)) {
+                abAppend(ab, "?", 1);
+            }
+            else {
+                abAppendRow(ab, row, j, len);
+            }
+            shown = 1;
+        }
+        rx += w;
+        j += len;
     }
-
-    free(buf);
-    editorSetStatusMessage("Cannot save! I/O error: %s", strerror(errno));
+    if (color != HL_NORMAL) {
+        abAppend(ab, "\x1b[39m", 5);
+    }
+    return rx;
 }
 
-/*** ---------- append buffer ---------- ***/
+// appends render[at, at + len) of row in the colors E.hl gives it, one
+// escape sequence per run of a color
+void abAppendHighlighted(struct abuf *ab, erow *row, char *render, int at, int len) {
+    int end = at + len;
+    while (at < end) {
+        int run = at;
+        while (run < end && E.hl[run] == E.hl[at]) {
+            run++;
+        }
+        if (E.hl[at] != HL_NORMAL) {
+            char buf[16];
+            int n = snprintf(buf, sizeof(buf), "\x1b[%dm", editorSyntaxToColor(E.hl[at]));
+            abAppend(ab, buf, n);
+        }
+        if (row->flags & ROW_RAW) {
+            abAppendRow(ab, row, at, run - at);
+        }
+        else {
+            abAppend(ab, &render[at], run - at);
+        }
+        if (E.hl[at] != HL_NORMAL) {
+            abAppend(ab, "\x1b[39m", 5);
+        }
+        at = run;
+    }
+}
 
-struct abuf {
-    char *b;
-    int len;
-};
+void editorFrameInit(int rows) {
+    int j;
+    for (j = 0; j < E.framerows; j++) {
+        free(E.frame[j].b);
+    }
+    free(E.frame);
+    E.frame = calloc(rows, sizeof(struct frameLine));
+    if (E.frame == NULL) {
+        die("calloc");
+    }
+    E.framerows = rows;
+    E.framevalid = 0;
+}
 
-#define ABUF_INIT {NULL, 0};
+// sends screen line y only if it differs from what the terminal shows
+void editorFrameLine(struct abuf *ab, int y, const char *s, int len) {
+    struct frameLine *fl = &E.frame[y];
+    if (E.framevalid && fl->len == len && (len == 0 || memcmp(fl->b, s, len) == 0)) {
+        return;
+    }
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+    abAppend(ab, buf, n);
+    abAppend(ab, s, len);
+    // <esc>[K to clear right of cursor
+    abAppend(ab, "\x1b[K", 3);
 
-    if (new == NULL) {
-        return;
+    if (len > fl->cap) {
+        int cap = fl->cap * 2 > len ? fl->cap * 2 : len;
+        char *b = realloc(fl->b, cap);
+        if (b == NULL) {
+            die("realloc");
+        }
+        fl->b = b;
+        fl->cap = cap;
     }
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    if (len > 0) {
+        memcpy(fl->b, s, len);
+    }
+    fl->len = len;
 }
 
-void abFree(struct abuf *ab) {
-    free(ab->b);
-}
+// when the view moved by less than a screen, let the terminal shift the
+// lines it already has inside a scroll region (LF at the bottom margin, RI
+// at the top) and shift the retained frame to match, so only the newly
+// exposed lines get sent
+void editorFrameScroll(struct abuf *ab) {
+    int top = E.wrap ? ropeLinesBefore(E.rowoff) + E.wrapoff : E.rowoff;
+    int delta = top - E.frametop;
+    int n = delta > 0 ? delta : -delta;
 
-/*** ---------- OUTPUT ---------- ***/
+    if (E.framevalid && E.coloff == E.framecoloff && n > 0 && n < E.screenrows) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.screenrows);
+        abAppend(ab, buf, len);
+        if (delta > 0) {
+            len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows);
+            abAppend(ab, buf, len);
+        }
+        else {
+            abAppend(ab, "\x1b[H", 3);
+        }
+        int j;
+        for (j = 0; j < n; j++) {
+            abAppend(ab, delta > 0 ? "\n" : "\x1bM", delta > 0 ? 1 : 2);
+        }
+        abAppend(ab, "\x1b[r", 3);
 
-void editorScroll() {
-    E.rx = 0;
-    if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        struct frameLine moved[n];
+        if (delta > 0) {
+            memcpy(moved, E.frame, sizeof(moved));
+            memmove(E.frame, E.frame + n, sizeof(struct frameLine) * (E.screenrows - n));
+            memcpy(E.frame + E.screenrows - n, moved, sizeof(moved));
+            for (j = E.screenrows - n; j < E.screenrows; j++) {
+                E.frame[j].len = 0;
+            }
+        }
+        else {
+            memcpy(moved, E.frame + E.screenrows - n, sizeof(moved));
+            memmove(E.frame + n, E.frame, sizeof(struct frameLine) * (E.screenrows - n));
+            memcpy(E.frame, moved, sizeof(moved));
+            for (j = 0; j < n; j++) {
+                E.frame[j].len = 0;
+            }
+        }
     }
 
-    if (E.cy < E.rowoff) {
-        E.rowoff = E.cy;
-    }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
+    E.frametop = top;
+    E.framecoloff = E.coloff;
+}
+
+// appends the screen line of row at that starts at column coloff, and
+// returns the column the line after it would start at when wrapping. fresh
+// is set for the first line drawn of a row, which highlights it
+int editorDrawRow(struct abuf *line, erow *row, int at, int coloff, int fresh) {
+    if (!editorRowIsAscii(row)) {
+        if (E.syntax && fresh) {
+            syntaxHighlightRow(row, at);
+        }
+        return abAppendDecoded(line, row, E.syntax ? E.hl : NULL, coloff);
     }
 
-    if (E.cx < E.coloff) {
-        E.coloff = E.rx;
+    char *render = editorRowRender(row);
+    int len = row->rsize - coloff;
+    // If length of row test will overflow, truncate
+    if (len < 0) {
+        len = 0;
     }
-    if (E.cx >= E.coloff + E.screencols) {
-        E.coloff = E.rx - E.screencols + 1;
+    if (len > E.screencols) {
+        len = E.screencols;
+    }
+    if (E.syntax) {
+        if (fresh) {
+            syntaxHighlightRow(row, at);
+        }
+        abAppendHighlighted(line, row, render, coloff, len);
+    }
+    else if (row->flags & ROW_RAW) {
+        abAppendRow(line, row, coloff, len);
     }
+    else {
+        abAppend(line, &render[coloff], len);
+    }
+    return coloff + E.screencols;
 }
 
 void editorDrawRows(struct abuf *ab) {
+    struct abuf *line = &E.line;
     int y;
+    int at = E.rowoff;
+    erow *row = editorRowAt(at);
+    // which screen line of the row comes next when wrapping, and its column
+    int k = E.wrap ? E.wrapoff : 0;
+    int start = row && E.wrap ? editorRowLineStart(row, k) : E.coloff;
+    int fresh = 1;
     for (y = 0; y < E.screenrows ; y++) {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows) {
+        abReset(line);
+        if (row == NULL) {
             if (E.numrows == 0 && y == E.screenrows / 3) {
                 char welcome[80];
                 int welcomelen = snprintf(welcome, sizeof(welcome), 
@@ -545,100 +5494,141 @@ void editorDrawRows(struct abuf *ab) {
                 }
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
+                    abAppend(line, "~", 1);
                     padding--;
                 }
-                while (padding--) {
-                    abAppend(ab, " ", 1);
-                }
-                abAppend(ab, welcome, welcomelen);
+                abFill(line, ' ', padding);
+                abAppend(line, welcome, welcomelen);
             }
             else {
-                abAppend(ab, "~", 1);
+                abAppend(line, "~", 1);
             }
         }
+        else if (E.wrap && k + 1 < row->lines) {
+            start = editorDrawRow(line, row, at, start, fresh);
+            k++;
+            fresh = 0;
+        }
         else {
-            int len = E.row[filerow].rsize - E.coloff;
-            // If length of row test will overflow, truncate
-            if (len < 0) {
-                len = 0;
-            }
-            if (len > E.screencols) {
-                len = E.screencols;
-            }
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
+            editorDrawRow(line, row, at, start, fresh);
+            row = editorRowNext(row);
+            at++;
+            k = 0;
+            start = E.coloff;
+            fresh = 1;
         }
 
-        // <esc>[K to clear right of cursor
-        abAppend(ab, "\x1b[K", 3);
-
-        abAppend(ab, "\r\n", 2);
+        editorFrameLine(ab, y, line->b, line->len);
     }
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[7m", 4);  // invert colors
+    struct abuf *line = &E.line;
+    abReset(line);
+    abAppend(line, "\x1b[7m", 4);  // invert colors
     char status[80], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", 
                        E.filename ? E.filename : "[No Name]", E.numrows,
                        E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+    char filetype[16] = "";
+    if (E.syntax) {
+        snprintf(filetype, sizeof(filetype), "%s | ", E.syntax->filetype);
+    }
+    char index[32] = "";
+    if (I.running) {
+        int built = __atomic_load_n(&I.built, __ATOMIC_ACQUIRE);
+        if (built < I.nblocks) {
+            snprintf(index, sizeof(index), "indexing %d%% | ", built * 100 / I.nblocks);
+        }
+        else {
+            double mb = I.nblocks * indexWords() * sizeof(unsigned long long) / 1048576.0;
+            snprintf(index, sizeof(index), "index %.1fMB | ", mb);
+        }
+    }
+    int rlen;
+    if (T.hud) {
+        // microseconds the last key and frame took in every stage
+        rlen = snprintf(rstatus, sizeof(rstatus), "rd %lld ps %lld bd %lld wr %lld us | %s%s%s%d/%d",
+                        T.last[TRACE_READ] / 1000, T.last[TRACE_PROCESS] / 1000,
+                        T.last[TRACE_BUILD] / 1000, T.last[TRACE_WRITE] / 1000,
+                        E.wrap ? "wrap | " : "", filetype, index, E.cy + 1, E.numrows);
+    }
+    else {
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s%d/%d", E.wrap ? "wrap | " : "",
+                        filetype, index, E.cy + 1, E.numrows);
+    }
+    if (rlen >= (int)sizeof(rstatus)) {
+        rlen = sizeof(rstatus) - 1;
+    }
     if (len > E.screencols) {
         len = E.screencols;
     }
-    abAppend(ab, status, len);
-    while (len < E.screencols) {
+    abAppend(line, status, len);
+    if (len < E.screencols) {
         // print rstatus when it lines up with end of line
-        if (E.screencols - len == rlen) { 
-            abAppend(ab, rstatus, rlen);
-            break;
+        if (E.screencols - len >= rlen) {
+            abFill(line, ' ', E.screencols - len - rlen);
+            abAppend(line, rstatus, rlen);
         }
         else {
-            abAppend(ab," ", 1);
-            len++;
+            abFill(line, ' ', E.screencols - len);
         }
     }
-    abAppend(ab, "\x1b[m", 3);  //invert colors back to normal
-    abAppend(ab, "\r\n", 2);
+    abAppend(line, "\x1b[m", 3);  //invert colors back to normal
+    editorFrameLine(ab, E.screenrows, line->b, line->len);
 }
 
 void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);  // clear message bar
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) {
         msglen = E.screencols;
     }
-    if (msglen && time(NULL) - E.statusmsg_time < 5) {
-        abAppend(ab, E.statusmsg, msglen);
+    if (msglen == 0 || time(NULL) - E.statusmsg_time >= CRATE_MSG_TIMEOUT) {
+        msglen = 0;
     }
+    editorFrameLine(ab, E.screenrows + 1, E.statusmsg, msglen);
 }
 
 void editorRefreshScreen() {
+    long long t = traceNow();
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
+    struct abuf *ab = &E.out;
+    abReset(ab);
 
     // <esc>[l to hide cursor
-    abAppend(&ab, "\x1b[?25l", 6);
-    // <esc>[2j escape sequence to clear full screen
-    // abAppend(&ab, "\x1b[2J", 4);
-    // [H to move cursor to top left corner
-    abAppend(&ab, "\x1b[H", 3);
+    abAppend(ab, "\x1b[?25l", 6);
 
-    // row setup
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    // only lines that changed since the last frame are sent
+    editorFrameScroll(ab);
+    editorDrawRows(ab);
+    // the buffer no longer matches the file, whatever was read as zeros
+    if (E.mapcut) {
+        E.mapcut = 0;
+        E.dirty++;
+        editorSetStatusMessage("File was truncated on disk! Text past its end reads as NULs");
+    }
+    editorDrawStatusBar(ab);
+    editorDrawMessageBar(ab);
+    E.framevalid = 1;
 
     // cursor position
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1, (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cury + 1, E.curx + 1);
+    abAppend(ab, buf, len);
 
-    abAppend(&ab, "\x1b[?25h", 6);
+    abAppend(ab, "\x1b[?25h", 6);
+    traceSpan(TRACE_BUILD, 0, t);
+
+    t = traceNow();
+    abFlush(ab, E.outfd);
+    traceSpan(TRACE_WRITE, 0, t);
+    E.lastframe = traceNow();
+}
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+// the message bar is redrawn once the message is too old to show
+void editorStatusExpired(void *arg) {
+    (void)arg;
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -647,21 +5637,26 @@ void editorSetStatusMessage(const char *fmt, ...) {
     vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
     va_end(ap);
     E.statusmsg_time = time(NULL);
+    editorAddTimer(CRATE_MSG_TIMEOUT * 1000, editorStatusExpired, NULL);
 }
 
 /*** ---------- INPUT ---------- ***/
 
 void editorMoveCursor(int key) {
-    erow *row = (E.cy > E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
+    if (E.wrap && (key == ARROW_UP || key == ARROW_DOWN)) {
+        editorWrapMove(key == ARROW_UP ? -1 : 1);  // a screen line at a time
+        return;
+    }
 
     switch (key) {
         case ARROW_LEFT:
             if (E.cx != 0) {
-                E.cx--;
+                E.cx = editorRowPrevGrapheme(row, E.cx);
             }
             else if (E.cy > 0) {
                 E.cy --;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_DOWN:
@@ -671,7 +5666,7 @@ void editorMoveCursor(int key) {
             break;
         case ARROW_RIGHT:
             if (row && E.cx < row->size) {
-                E.cx++;
+                E.cx = editorRowNextGrapheme(row, E.cx);
             }
             else if (row && E.cx == row->size) {
                 E.cy++;
@@ -685,17 +5680,45 @@ void editorMoveCursor(int key) {
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
+    // going up or down keeps the byte offset between ASCII rows, as it
+    // always has, and the column when either row has wider chars
+    erow *to = editorRowAt(E.cy);
+    if ((key == ARROW_UP || key == ARROW_DOWN) && row && to && row != to &&
+        (!editorRowIsAscii(row) || !editorRowIsAscii(to))) {
+        // paging moves cy first, so cx may not fit the row it left
+        int cx = E.cx < row->size ? E.cx : row->size;
+        E.cx = editorRowRxToCx(to, editorRowCxToRx(row, cx));
+    }
+    int rowlen = to ? to->size : 0;
     if (E.cx > rowlen) {
         E.cx = rowlen;
     }
+    else if (to) {
+        E.cx = editorRowBoundary(to, E.cx);  // never part way into a char
+    }
+}
+
+// takes in everything up to the \x1b[201~ closing a bracketed paste and
+// inserts it as one block
+void editorPaste() {
+    struct abuf buf = {NULL, 0, 0};
+    char c;
+    while (editorReadWithin(&c, CRATE_PASTE_TIMEOUT) == 1) {
+        abAppend(&buf, &c, 1);
+        if (c == '~' && buf.len >= 6 && memcmp(&buf.b[buf.len - 6], "\x1b[201~", 6) == 0) {
+            buf.len -= 6;
+            break;
+        }
+    }
+    editorInsertText(buf.b, buf.len);
+    abFree(&buf);
 }
 
 void editorProcessKeypress() {
     static int quit_times = CRATE_QUIT_TIMES;
 
     int c = editorReadKey();
+    long long t = traceNow();
 
     switch (c) {
         case '\r':
@@ -707,13 +5730,15 @@ void editorProcessKeypress() {
                 editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                                         "Press Ctrl-Q %d more times to quit.", quit_times);
                 quit_times--;
+                traceSpan(TRACE_PROCESS, 0, t);
                 return;
             }
 
+            swapDiscard();
             // clear screen
-            write(STDOUT_FILENO, "\x1b[2J", 4);
+            write(E.outfd, "\x1b[2J", 4);
             // cursor to top left
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            write(E.outfd, "\x1b[H", 3);
             exit(0);
             break;
 
@@ -721,13 +5746,37 @@ void editorProcessKeypress() {
             editorSave();
             break;
 
+        case CTRL_KEY('f'):
+            editorFind();
+            break;
+
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
+        case PASTE_START:
+            editorPaste();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
+        case CTRL_KEY('w'):
+            editorToggleWrap();
+            break;
+
         case HOME_KEY:
             E.cx = 0;
             break;
         
         case END_KEY:
             if (E.cy < E.numrows) {
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         
@@ -742,6 +5791,12 @@ void editorProcessKeypress() {
         
         case PAGE_UP:
         case PAGE_DOWN:
+            if (E.wrap) {
+                // to the top or bottom line, then a screen further
+                editorWrapMove(c == PAGE_UP ? -E.cury - E.screenrows
+                                            : 2 * E.screenrows - 1 - E.cury);
+                break;
+            }
             {
                 if (c == PAGE_UP) {
                     E.cy = E.rowoff;
@@ -767,7 +5822,19 @@ void editorProcessKeypress() {
             editorMoveCursor(c);
             break;
         
-        case CTRL_KEY('l'):  // ignore, traditionally refresh
+        case CTRL_KEY('l'):  // repaint everything, and report render memory
+            E.framevalid = 0;
+            editorSetStatusMessage("render: %zu KB cached, %zu KB shared with text",
+                                   E.rbytes / 1024, E.rshared / 1024);
+            break;
+
+        case CTRL_KEY('t'):  // toggle stage timings, report open and save
+            T.hud = !T.hud;
+            editorSetStatusMessage("trace: open %.1f ms, save %.1f ms%s",
+                                   T.last[TRACE_OPEN] / 1e6, T.last[TRACE_SAVE] / 1e6,
+                                   getenv("CRATE_TRACE") ? ", dumped at exit" : "");
+            break;
+
         case '\x1b':
             break;
         
@@ -776,9 +5843,34 @@ void editorProcessKeypress() {
             break;
     }
     quit_times = CRATE_QUIT_TIMES;
+    editorGapFollowCursor();
+    traceSpan(TRACE_PROCESS, 0, t);
+}
+
+// applies the next key and every key queued behind it, then draws one frame
+// for all of them. A burst gets a frame at least every CRATE_FRAME_BUDGET ms
+// so the screen cannot fall far behind; with a frame cap, keys arriving
+// before the next frame is due are folded into it as well
+void editorProcessKeys() {
+    editorProcessKeypress();
+    long long start = traceNow();
+    long long budget = CRATE_FRAME_BUDGET * 1000000LL;
+    while (traceNow() - start < budget) {
+        int wait = 0;
+        if (E.frameinterval) {
+            long long due = E.lastframe + E.frameinterval - traceNow();
+            wait = due > 0 ? (int)((due + 999999) / 1000000) : 0;
+        }
+        if (!editorInputReady(wait)) {
+            break;
+        }
+        editorScroll();  // page up/down go by rowoff, keep it current
+        editorProcessKeypress();
+    }
+    editorRefreshScreen();
 }
 
-char *editorPrompt(char *prompt) {
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
 
@@ -791,22 +5883,33 @@ char *editorPrompt(char *prompt) {
 
         int c = editorReadKey();
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+            // a UTF-8 char goes as a whole
+            while (buflen != 0 && (buf[buflen - 1] & 0xc0) == 0x80) {
+                buflen--;
+            }
             if (buflen != 0) {
                 buf[--buflen] = '\0';
             }
+            buf[buflen] = '\0';
         }
         else if (c == '\x1b') {
             editorSetStatusMessage("");
+            if (callback) {
+                callback(buf, c);
+            }
             free(buf);
             return NULL;
         }
         else if (c == '\r') {
             if (buflen != 0) {
                 editorSetStatusMessage("");
+                if (callback) {
+                    callback(buf, c);
+                }
                 return buf;
             }
         }
-        else if (!iscntrl(c) && c < 128) {
+        else if ((!iscntrl(c) && c < 128) || (c >= 128 && c < 256)) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
@@ -814,6 +5917,116 @@ char *editorPrompt(char *prompt) {
             buf[buflen++] = c;
             buf[buflen] = '\0';
         }
+
+        if (callback) {
+            callback(buf, c);
+        }
+    }
+}
+
+/*** ---------- bench ---------- ***/
+
+int benchCompare(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+void benchRecord(long long ns, size_t bytes) {
+    if (B.n == B.cap) {
+        B.cap = B.cap ? B.cap * 2 : 1024;
+        B.lat = realloc(B.lat, sizeof(long long) * B.cap);
+        B.bytes = realloc(B.bytes, sizeof(size_t) * B.cap);
+        if (B.lat == NULL || B.bytes == NULL) {
+            die("realloc");
+        }
+    }
+    B.lat[B.n] = ns;
+    B.bytes[B.n] = bytes;
+    B.n++;
+}
+
+double benchPercentile(double p) {
+    int i = (int)(p / 100.0 * (B.n - 1) + 0.5);
+    return B.lat[i] / 1000.0;
+}
+
+void benchReport() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    size_t total = 0;
+    size_t most = 0;
+    int j;
+    for (j = 0; j < B.n; j++) {
+        total += B.bytes[j];
+        if (B.bytes[j] > most) {
+            most = B.bytes[j];
+        }
+    }
+
+    printf("file         %s (%d rows)\n", E.filename ? E.filename : "-", E.numrows);
+    printf("open         %.3f ms\n", B.open_ns / 1e6);
+    printf("first frame  %.3f ms, %zu bytes\n", B.first_ns / 1e6, B.first_bytes);
+    printf("keys         %d\n", B.n);
+    if (B.n > 0) {
+        qsort(B.lat, B.n, sizeof(long long), benchCompare);
+        printf("latency us   p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+                benchPercentile(50), benchPercentile(90), benchPercentile(99),
+                benchPercentile(100));
+        printf("frame bytes  avg %.1f  max %zu  total %zu\n",
+                (double)total / B.n, most, total);
+    }
+    printf("peak rss     %ld KB\n", ru.ru_maxrss);
+    fflush(stdout);
+}
+
+// crate --bench ROWSxCOLS SCRIPT [FILE]
+// replays the raw keystroke bytes in SCRIPT as if typed into a ROWSxCOLS
+// terminal, throwing the frames away but counting their bytes. Runs until
+// the script ends (or the editor quits) and then prints what it measured
+void benchMain(int argc, char *argv[]) {
+    int rows, cols;
+    if (argc < 4 || sscanf(argv[2], "%dx%d", &rows, &cols) != 2 || rows < 3 || cols < 1) {
+        fprintf(stderr, "usage: %s --bench ROWSxCOLS SCRIPT [FILE]\n", argv[0]);
+        exit(1);
+    }
+    E.infd = open(argv[3], O_RDONLY);
+    if (E.infd == -1) {
+        perror(argv[3]);
+        exit(1);
+    }
+    E.outfd = open("/dev/null", O_WRONLY);
+    if (E.outfd == -1) {
+        perror("/dev/null");
+        exit(1);
+    }
+    E.headless = 1;
+    E.screenrows = rows;
+    E.screencols = cols;
+    initEditor();
+
+    long long t = traceNow();
+    if (argc >= 5) {
+        editorOpen(argv[4]);
+    }
+    B.open_ns = traceNow() - t;
+    atexit(benchReport);
+
+    // unless opening the file had something to say
+    if (E.statusmsg[0] == '\0') {
+        editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = replace | Ctrl-Z = undo | Ctrl-Y = redo");
+    }
+    t = traceNow();
+    editorRefreshScreen();
+    B.first_ns = traceNow() - t;
+    B.first_bytes = E.outbytes;
+
+    while (1) {
+        size_t before = E.outbytes;
+        t = traceNow();
+        editorProcessKeys();
+        benchRecord(traceNow() - t, E.outbytes - before);
     }
 }
 
@@ -825,31 +6038,95 @@ void initEditor() {
     E.rx = 0;
     E.rowoff = 0;
     E.coloff = 0;
+    E.wrap = 0;
+    E.wrapoff = 0;
+    E.wrapcols = -1;
+    E.cury = 0;
+    E.curx = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = NULL;
+    E.freenodes = NULL;
+    E.gaprow = NULL;
+    E.seed = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+    if (E.seed == 0) {
+        E.seed = 0x9e3779b9;
+    }
     E.dirty = 0;
     E.filename = NULL;
+    E.syntax = NULL;
+    E.hlvalid = 0;
+    E.hl = NULL;
+    E.hlcap = 0;
+    E.map = NULL;
+    E.maplen = 0;
+    E.mapfd = -1;
+    E.pagesize = sysconf(_SC_PAGESIZE);
+    E.mapcut = 0;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = editorMapFault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+    renderCacheInit();
+    E.frame = NULL;
+    E.framerows = 0;
+    E.frametop = 0;
+    E.framecoloff = 0;
+    // wcwidth only knows how wide chars are in a UTF-8 locale
+    if (setlocale(LC_CTYPE, "") == NULL || MB_CUR_MAX == 1) {
+        setlocale(LC_CTYPE, "C.UTF-8");
+    }
+    E.out = (struct abuf){NULL, 0, 0};
+    E.line = (struct abuf){NULL, 0, 0};
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
+    E.sigfd = -1;
+    E.ntimers = 0;
+    U.undo = (struct undoStack){NULL, 0, 0, 0, 0, NULL, 0, 0};
+    U.redo = (struct undoStack){NULL, 0, 0, 0, 0, NULL, 0, 0};
+    char *budget = getenv("CRATE_UNDO_KB");
+    U.budget = budget && atol(budget) > 0 ? (size_t)atol(budget) * 1024 : CRATE_UNDO_BUDGET;
+    U.sealed = 0;
+    T.base = traceNow();
+    if (getenv("CRATE_TRACE")) {
+        atexit(traceDump);
+    }
 
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
+    // headless runs come with their screen size set
+    if (!E.headless && getWindowSize(&E.screenrows, &E.screencols) == -1) {
         die("getWindowsSize");
     }
     E.screenrows -= 2;  //allow one row for status bar, one for message bar
+    editorFrameInit(E.screenrows + 2);
 }
 
 int main(int argc, char *argv[]) {
+    E.infd = STDIN_FILENO;
+    E.outfd = STDOUT_FILENO;
+    char *fps = getenv("CRATE_FPS");
+    if (fps && atoi(fps) > 0) {
+        E.frameinterval = 1000000000LL / atoi(fps);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        benchMain(argc, argv);
+    }
+
     enableRawMode();
     initEditor();
+    editorInitSignals();
     if (argc >= 2) {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-Q = quit");
+    // unless opening the file had something to say
+    if (E.statusmsg[0] == '\0') {
+        editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = replace | Ctrl-Z = undo | Ctrl-Y = redo");
+    }
 
+    editorRefreshScreen();
     while (1) {
-        editorRefreshScreen();
-        editorProcessKeypress();
+        editorProcessKeys();
         // char c = '\0';
         // if (read(STDIN_FILENO, &c, 1) == -1 && errno != EAGAIN) {
         //     die("read");